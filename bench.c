@@ -0,0 +1,399 @@
+// Replays scripted workloads against the editor on a pseudo-terminal, typing into it the way a user
+// would, and reports per operation latencies, bytes sent to the terminal per frame, system calls and
+// allocations. Built and run by `make bench`, which sets the size of the generated document.
+#define RED_NO_MAIN
+#include "main.c"
+
+#define BENCH_ROWS 50
+#define BENCH_COLS 120
+#define TYPED_CHARS 100000
+#define PASTE_BYTES (10 << 20)
+
+/*** Counters ***/
+// System calls and allocations are counted by wrapping them at link time (see the Makefile), so only
+// the editor's own calls show up, from whichever thread makes them.
+struct counters {
+    long syscalls, allocations;
+    long long terminal_read, terminal_written;
+};
+
+struct counters counters;
+
+#define COUNT(counter, n) __atomic_fetch_add(&counters.counter, (n), __ATOMIC_RELAXED)
+#define COUNTED(counter) __atomic_load_n(&counters.counter, __ATOMIC_RELAXED)
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+ssize_t __real_read(int fd, void *buffer, size_t size);
+ssize_t __real_write(int fd, const void *buffer, size_t size);
+ssize_t __real_writev(int fd, const struct iovec *iov, int count);
+int __real_poll(struct pollfd *fds, nfds_t count, int timeout);
+ssize_t __real_copy_file_range(int in, loff_t *in_offset, int out, loff_t *out_offset, size_t size,
+                               unsigned int flags);
+int __real_fsync(int fd);
+
+void *__wrap_malloc(size_t size) {
+    COUNT(allocations, 1);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    COUNT(allocations, 1);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+    COUNT(allocations, 1);
+    return __real_realloc(pointer, size);
+}
+
+ssize_t __wrap_read(int fd, void *buffer, size_t size) {
+    ssize_t result = __real_read(fd, buffer, size);
+    COUNT(syscalls, 1);
+    if (fd == EC.terminal_in && result > 0) COUNT(terminal_read, result);
+    return result;
+}
+
+ssize_t __wrap_write(int fd, const void *buffer, size_t size) {
+    ssize_t result = __real_write(fd, buffer, size);
+    COUNT(syscalls, 1);
+    if (fd == EC.terminal_out && result > 0) COUNT(terminal_written, result);
+    return result;
+}
+
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int count) {
+    ssize_t result = __real_writev(fd, iov, count);
+    COUNT(syscalls, 1);
+    if (fd == EC.terminal_out && result > 0) COUNT(terminal_written, result);
+    return result;
+}
+
+int __wrap_poll(struct pollfd *fds, nfds_t count, int timeout) {
+    COUNT(syscalls, 1);
+    return __real_poll(fds, count, timeout);
+}
+
+ssize_t __wrap_copy_file_range(int in, loff_t *in_offset, int out, loff_t *out_offset, size_t size,
+                               unsigned int flags) {
+    COUNT(syscalls, 1);
+    return __real_copy_file_range(in, in_offset, out, out_offset, size, flags);
+}
+
+int __wrap_fsync(int fd) {
+    COUNT(syscalls, 1);
+    return __real_fsync(fd);
+}
+
+/*** Virtual terminal ***/
+// The other end of the pseudo-terminal. Keys are typed into it and whatever the editor draws is
+// drained and thrown away, like a terminal that renders instantly.
+struct terminal {
+    int master;
+    long long fed; // Bytes typed so far.
+};
+
+struct terminal terminal;
+
+void *terminal_sink(void *argument) {
+    char discard[1 << 16];
+    (void) argument;
+    while (__real_read(terminal.master, discard, sizeof(discard)) > 0);
+    return NULL;
+}
+
+struct feed {
+    const char *keys;
+    size_t size;
+};
+
+void *terminal_feed(void *argument) {
+    struct feed *feed = argument;
+    for (size_t done = 0; done < feed->size;) {
+        ssize_t written = __real_write(terminal.master, &feed->keys[done], feed->size - done);
+        if (written == -1 && errno == EINTR) continue;
+        if (written == -1) break;
+        done += written;
+    }
+    return NULL;
+}
+
+void terminal_open() {
+    terminal.master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (terminal.master == -1 || grantpt(terminal.master) == -1 || unlockpt(terminal.master) == -1) {
+        perror("posix_openpt");
+        exit(1);
+    }
+    int slave = open(ptsname(terminal.master), O_RDWR | O_NOCTTY);
+    if (slave == -1) {
+        perror("open");
+        exit(1);
+    }
+
+    struct winsize size = {BENCH_ROWS, BENCH_COLS, 0, 0};
+    ioctl(terminal.master, TIOCSWINSZ, &size);
+    pthread_t thread;
+    pthread_create(&thread, NULL, terminal_sink, NULL);
+    pthread_detach(thread);
+
+    editor_enable(slave, slave);
+    editor_init();
+}
+
+/*** Measurements ***/
+struct measure {
+    const char *name;
+    double *latencies; // Milliseconds taken by each operation.
+    int count, capacity, frames;
+    long long bytes;
+    long syscalls, allocations;
+};
+
+double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e3 + time.tv_nsec / 1e6;
+}
+
+void frame(struct measure *measure) {
+    long long written = COUNTED(terminal_written);
+    refresh_screen();
+    measure->bytes += COUNTED(terminal_written) - written;
+    ++measure->frames;
+}
+
+void measure_start(struct measure *measure, const char *name) {
+    memset(measure, 0, sizeof(struct measure));
+    measure->name = name;
+    measure->syscalls = COUNTED(syscalls);
+    measure->allocations = COUNTED(allocations);
+}
+
+void measure_add(struct measure *measure, double latency) {
+    if (measure->count == measure->capacity) {
+        measure->capacity = measure->capacity ? measure->capacity * 2 : 1024;
+        measure->latencies = realloc(measure->latencies, sizeof(double) * measure->capacity);
+    }
+    measure->latencies[measure->count++] = latency;
+}
+
+int latency_compare(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+double percentile(struct measure *measure, int p) {
+    int i = (int) ((long long) (measure->count - 1) * p / 100);
+    return measure->count ? measure->latencies[i] : 0;
+}
+
+void measure_report(struct measure *measure) {
+    int count = measure->count ? measure->count : 1;
+    qsort(measure->latencies, measure->count, sizeof(double), latency_compare);
+    printf("%-12s %8d %10.3f %10.3f %10.3f %10.3f %12lld %12.1f %12.1f\n",
+           measure->name, measure->count,
+           percentile(measure, 50), percentile(measure, 90), percentile(measure, 99), percentile(measure, 100),
+           measure->frames ? measure->bytes / measure->frames : 0,
+           (double) (COUNTED(syscalls) - measure->syscalls) / count,
+           (double) (COUNTED(allocations) - measure->allocations) / count);
+    fflush(stdout);
+    free(measure->latencies);
+}
+
+// Types keys into the terminal and has the editor take all of them, drawing whenever it runs out of
+// input like the main loop does. Returns the milliseconds that took.
+double type(struct measure *measure, const char *keys, size_t size) {
+    struct feed feed = {keys, size};
+    pthread_t feeder;
+    double start = now();
+
+    pthread_create(&feeder, NULL, terminal_feed, &feed);
+    terminal.fed += size;
+    while (COUNTED(terminal_read) < terminal.fed || input_pending()) {
+        process_key();
+        if (!input_pending()) frame(measure);
+    }
+    pthread_join(feeder, NULL);
+
+    double latency = now() - start;
+    measure_add(measure, latency);
+    return latency;
+}
+
+/*** Workloads ***/
+// Fills a file with size megabytes of lines of words, numbers and the odd tab.
+void document_generate(char *path, long size) {
+    static const char *words[] = {"alpha", "beta", "gamma", "delta", "needle", "haystack", "red", "editor"};
+    unsigned int seed = 12345;
+    char block[1 << 16];
+    int fd = mkstemp(path), used = 0;
+    if (fd == -1) {
+        perror("mkstemp");
+        exit(1);
+    }
+
+    for (long long total = 0; total < (long long) size << 20;) {
+        seed = seed * 1103515245 + 12345;
+        int words_in_line = seed >> 16 & 15;
+        for (int k = 0; k < words_in_line; ++k) {
+            seed = seed * 1103515245 + 12345;
+            if ((seed >> 8 & 7) == 0) used += sprintf(&block[used], "\t%u ", seed >> 20);
+            else used += sprintf(&block[used], "%s ", words[seed >> 16 & 7]);
+        }
+        block[used++] = '\n';
+        if (used > (int) sizeof(block) - 512) {
+            if (__real_write(fd, block, used) != used) {
+                perror("write");
+                exit(1);
+            }
+            total += used;
+            used = 0;
+        }
+    }
+    if (used && __real_write(fd, block, used) != used) perror("write");
+    close(fd);
+}
+
+void bench_open(char *path) {
+    struct measure measure;
+    measure_start(&measure, "first screen");
+    double start = now();
+    open_file(path);
+    load_wait(EC.rows);
+    frame(&measure);
+    measure_add(&measure, now() - start);
+    measure_report(&measure);
+
+    measure_start(&measure, "full load");
+    load_wait(INT_MAX);
+    double loaded = now() - start;
+    measure_add(&measure, loaded);
+    measure_report(&measure);
+    printf("%-12s %.0f MB/s over %d lines\n", "", EC.map_size / 1048576.0 / (loaded / 1e3), EC.document_rows);
+    if (EC.map_size >= INDEX_MIN_SIZE) index_start();
+}
+
+void bench_scroll() {
+    struct measure measure;
+    measure_start(&measure, "scroll");
+    while (EC.cursor_y < EC.document_rows)
+        type(&measure, "\x1b[6~", 4);
+    measure_report(&measure);
+}
+
+void bench_type() {
+    struct measure measure;
+    measure_start(&measure, "type");
+    type(&measure, "\x05", 1);
+    for (int k = 0; k < TYPED_CHARS; ++k) {
+        char key = k % 64 == 63 ? '\r' : "the quick brown fox 0123 "[k % 25];
+        type(&measure, &key, 1);
+    }
+    measure_report(&measure);
+}
+
+void bench_paste() {
+    struct measure measure;
+    char *paste = malloc(PASTE_BYTES + 12);
+    size_t size = 0;
+
+    size += sprintf(paste, "\x1b[200~");
+    while (size < PASTE_BYTES)
+        size += sprintf(&paste[size], "pasted line %zu with\ta tab and some text\r", size);
+    size += sprintf(&paste[size], "\x1b[201~");
+
+    measure_start(&measure, "paste 10MB");
+    type(&measure, paste, size);
+    measure_report(&measure);
+    free(paste);
+}
+
+// Lets a search going through the document in the background get to the end, like someone waiting for
+// its count would.
+void find_wait() {
+    while (EC.finding.running) {
+        pthread_mutex_unlock(&EC.lock);
+        usleep(100);
+        pthread_mutex_lock(&EC.lock);
+    }
+}
+
+void bench_find() {
+    static const char *commands[] = {"\x03" "find needle\r", "\x03" "find haystack red\r", "\x03" "find ne.dle\r",
+                                     "\x03" "find [0-9][0-9]*7\r"};
+    static const char search[] = "\x03" "find [0-9]*1[0-9]*2\r";
+    struct measure measure;
+
+    measure_start(&measure, "find");
+    for (size_t k = 0; k < sizeof(commands) / sizeof(commands[0]); ++k) {
+        double start = now();
+        type(&measure, commands[k], strlen(commands[k]));
+        find_wait();
+        measure.latencies[measure.count - 1] = now() - start; // Up to the count of incidences.
+    }
+    measure_report(&measure);
+
+    measure_start(&measure, "find next");
+    for (int k = 0; k < 1000; ++k)
+        type(&measure, "\x0e", 1);
+    measure_report(&measure);
+
+    // Keys typed while a search is still going, up to the Esc that stops it.
+    measure_start(&measure, "keys finding");
+    type(&measure, search, strlen(search));
+    measure.count = 0;
+    for (int k = 0; k < 100 && EC.finding.running; ++k)
+        type(&measure, "\x1b[B", 3);
+    type(&measure, "\x1b", 1);
+    measure_report(&measure);
+    printf("%-12s %s\n", "", EC.status);
+}
+
+void bench_replace() {
+    static const char *commands[] = {"\x03" "replace needle pin\r", "\x03" "replace \\(ha\\)y\\(stack\\) \\2\\1\r"};
+    struct measure measure;
+
+    measure_start(&measure, "replace");
+    for (size_t k = 0; k < sizeof(commands) / sizeof(commands[0]); ++k)
+        type(&measure, commands[k], strlen(commands[k]));
+    measure_report(&measure);
+    printf("%-12s %s\n", "", EC.status);
+}
+
+void bench_save() {
+    struct measure measure;
+    measure_start(&measure, "save");
+    type(&measure, "\x03" "save\r", 6);
+    measure_report(&measure);
+    printf("%-12s %s\n", "", EC.status);
+}
+
+int main(int argc, char *argv[]) {
+    long size = argc > 1 ? atol(argv[1]) : 1024;
+    const char *directory = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/red-bench-XXXXXX", directory);
+    fprintf(stderr, "Generating %ld MB document in %s...\n", size, path);
+    document_generate(path, size);
+
+    terminal_open();
+    printf("%-12s %8s %10s %10s %10s %10s %12s %12s %12s\n",
+           "operation", "ops", "p50 ms", "p90 ms", "p99 ms", "max ms", "bytes/frame", "syscalls/op", "allocs/op");
+    bench_open(path);
+    // The mapping keeps the document alive, so nothing is left behind in case the benchmark gets killed.
+    // Only saving brings it back for a moment.
+    char *index = line_index_path(path);
+    unlink(index);
+    unlink(path);
+    free(index);
+
+    bench_scroll();
+    bench_type();
+    bench_paste();
+    bench_find();
+    bench_replace();
+    bench_save();
+    unlink(path);
+    return 0;
+}
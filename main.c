@@ -1,27 +1,87 @@
+/*** Feature test macros ***/
+// Must precede every include to take effect.
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
 /*** Includes ***/
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 #include <regex.h>
+#ifndef RED_NO_STATS
+#include <malloc.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /*** Definitions ***/
-#define _POSIX_C_SOURCE 200809L
-#define _DEFAULT_SOURCE
-#define _BSD_SOURCE
-#define _GNU_SOURCE
 #define TAB_STOP 4
+#define ROW_CHUNK 512
+#define TRIGRAM_HASH_BITS 13
+#define TRIGRAM_BYTES (1 << TRIGRAM_HASH_BITS >> 3)
+#define INDEX_MIN_SIZE (16 << 20) // Files at least this big get a trigram index built in the background.
+#define FIND_SLICE (1 << 14) // Rows a background search goes through each time it takes the document lock.
+#define LOAD_BLOCK (1 << 16) // Bytes scanned for newlines at a time while loading.
+#define LOAD_SLICE (1 << 20) // Bytes the background loader goes through between checks for a full chunk.
+#define LINE_INDEX_MIN_SIZE (16 << 20) // Files at least this big get their line offsets saved next to them.
+#define LINE_INDEX_MAGIC "redlines"
+#define SAVE_BATCH (1 << 20) // Bytes of edited rows gathered before they're written out.
+#define COPY_MIN (1 << 16) // Bytes of unchanged file worth a copy_file_range call of their own.
+#define LONG_ROW (1 << 16) // Rows at least this many bytes are only rendered around the visible columns.
+#define COLUMN_STRIDE 4096 // Bytes of a long row between the entries of its column index.
+#define RENDER_MARGIN 4096 // Columns of a long row rendered on either side of the screen.
+#define RENDER_SCREENS 2 // Screens of rows above and below the visible one that keep their render.
+#define STATUS_SECONDS 5 // How long status messages stay up.
+#define ESCAPE_WAIT 100 // Milliseconds to wait for the rest of an escape sequence.
+#define PASTE_WAIT 1000 // Milliseconds to wait for the rest of a paste before giving up on it.
+#define QUOTE_KINDS 3 // Most kinds of quote a language can have strings in.
+#define KEYWORD_SLOTS 512 // Hash table slots for the keywords of a language, at least twice as many.
+#define STATS_FRAMES 256 // Frame times kept to work out percentiles from.
+#define REPLACE_GROUPS 10 // Groups a replacement can refer to, \0 to \9.
 #define CTRL_KEY(k) ((k) & 0x1f)
-#define BUFFER_INIT {NULL, 0}
+#define BUFFER_INIT {NULL, 0, 0, NULL, 0, 0, NULL, 0, 0}
 #define enum_to_string(m) #m
+// Counters behind the stats overlay. They're cheap enough for the hot paths, and building with
+// -DRED_NO_STATS leaves them out altogether. Heap counters are updated from any thread.
+#ifndef RED_NO_STATS
+#define STAT_ADD(counter, n) __atomic_fetch_add(&EC.stats.counter, (n), __ATOMIC_RELAXED)
+#define STAT_HELD(counter, pointer) STAT_ADD(counter, (long long) malloc_usable_size(pointer))
+#define STAT_RELEASED(counter, pointer) STAT_ADD(counter, -(long long) malloc_usable_size(pointer))
+#define STAT_START(timer) (EC.stats.timer = -stats_clock()) // Timers hold minus their start while running.
+#define STAT_STOP(timer) (EC.stats.timer += stats_clock())
+#define STAT_SET(field, value) (EC.stats.field = (value))
+#else
+#define STAT_ADD(counter, n) ((void) 0)
+#define STAT_HELD(counter, pointer) ((void) 0)
+#define STAT_RELEASED(counter, pointer) ((void) 0)
+#define STAT_START(timer) ((void) 0)
+#define STAT_STOP(timer) ((void) 0)
+#define STAT_SET(field, value) ((void) 0)
+#endif
 #define stringify(m) enum_to_string(m)
 enum KEYS {
     BACKSPACE = 127,
@@ -35,31 +95,313 @@ enum KEYS {
     END_KEY,
     PAGE_UP,
     PAGE_DOWN,
+    REDRAW_KEY, // Nothing was pressed, but the screen is out of date.
+    PASTE_KEY, // Text was pasted, and is waiting in EC.paste.
     READ_MODE,
     EDIT_MODE
 };
+enum ROW_FLAGS {
+    ROW_BORROWED = 1, // Content points into memory the row doesn't own (e.g. the file mapping).
+    ROW_STALE = 2,    // render_content and highlight haven't been computed for the current content.
+    ROW_CLIPPED = 4   // render_content stops before the end of a long row.
+};
 enum HIGHLIGHTS {
     HL_DEFAULT = 0,
-    HL_NUMBER
+    HL_NUMBER,
+    HL_STRING,
+    HL_COMMENT,
+    HL_KEYWORD,
+    HL_TYPE
+};
+enum LEXER_STATES {
+    LEX_NORMAL = 0,
+    LEX_WORD,
+    LEX_NUMBER,
+    LEX_COMMENT_START, // First character of a two character comment marker.
+    LEX_LINE_COMMENT_OPEN, // Right after the marker, which turned out to be a comment too.
+    LEX_LINE_COMMENT,
+    LEX_BLOCK_COMMENT_OPEN,
+    LEX_BLOCK_COMMENT,
+    LEX_BLOCK_COMMENT_END, // First character of the closing marker.
+    LEX_BLOCK_COMMENT_CLOSE,
+    LEX_STRING, // Followed by the escape and closing quote states, for every kind of quote.
+    LEX_STATES = LEX_STRING + 3 * QUOTE_KINDS,
+    LEX_UNKNOWN = 255
 };
 
 /*** Structs ***/
+// What a row let go of to show itself, kept for the next row shown rather than given back to the heap.
+struct render_buffers {
+    char *content;
+    unsigned char *highlight;
+    struct row_cache *cache;
+    int capacity;
+};
+
+// A run of render columns sharing one highlight, and where its characters start in the encoded bytes.
+struct row_run {
+    int col, offset;
+    unsigned char highlight;
+};
+
+// The row as terminal-ready bytes, with an escape sequence only where the color changes.
+typedef struct row_cache {
+    char *bytes; // Unused when the row has no colors at all and render_content can be sent as is.
+    int size;    // -1 once render_content or highlight changed.
+    int capacity;
+    struct row_run *runs;
+    int run_count, run_capacity;
+} row_cache;
+
+// Where a long row stands at one of its COLUMN_STRIDE byte marks.
+struct checkpoint {
+    int column; // Render column.
+    unsigned char state; // Lexer state, when the row starts in its states_from.
+};
+
 typedef struct document_row {
     char *content, *render_content;
     int size, render_size;
+    int render_start; // Render column render_content starts at, only ever past 0 in long rows.
+    int render_capacity; // Of render_content and highlight alike.
+    int column_count, state_count; // Entries of columns whose column and state are still valid for the content.
+    struct checkpoint *columns; // Every COLUMN_STRIDE bytes of a long row, NULL until needed.
     unsigned char *highlight;
+    row_cache *cache;
+    unsigned char flags;
+    unsigned char state_in, state_out; // Lexer state highlight was computed from, and the one the row ends in.
+    unsigned char states_from; // Lexer state the states of columns were worked out from.
 } document_row;
 
+// A chunk of consecutive rows. Chunks form an implicit treap ordered by position where every node
+// knows how many rows its subtree holds, so any row can be located, inserted or removed in O(log n).
+typedef struct row_node {
+    struct row_node *left, *right;
+    unsigned int priority;
+    int rows; // Rows in the whole subtree.
+    int size; // Rows in this chunk.
+    unsigned char *trigrams; // Trigram bitmap of the rows, NULL until indexed.
+    char *text; // Bytes of the rows when only known from a line index, NULL once they're built.
+    size_t text_size;
+    document_row row[ROW_CHUNK];
+} row_node;
+
+// Header of the line index saved next to big files: where every chunk of ROW_CHUNK lines starts, valid
+// as long as the file keeps its size, modification time and the bytes sampled for the checksum.
+struct line_index {
+    char magic[8];
+    uint64_t size, mtime_sec, mtime_nsec, checksum;
+    uint64_t lines, stride;
+};
+
+// Mirror of what the terminal currently shows, so a refresh only sends the cells that changed.
+struct screen {
+    int rows, cols;
+    char *chars, *line_chars;
+    unsigned char *highlight, *line_highlight;
+    char *status_bar, *message_bar;
+    int status_bar_size, message_bar_size; // -1 when the terminal content is unknown.
+    int cursor_x, cursor_y;
+    int row_offset; // Document row shown on the first line, -1 when unknown.
+};
+
+// Output of one frame. Fragments are copied into an arena that is kept across frames, while bytes
+// that stay untouched until the flush (cached rows) are only referenced. Everything goes out with writev.
+struct buffer {
+    char *content; // Arena block being filled.
+    int size, capacity;
+    char **spent; // Blocks outgrown during this frame, released on the next reset.
+    int spent_count, spent_capacity;
+    struct iovec *iov;
+    int iov_count, iov_capacity;
+};
+
+// Threads kept around to split large jobs such as searches across every core.
+struct workers {
+    int size;
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+    void (*task)(int task, int worker, void *context);
+    void *context;
+    int tasks, next, pending, generation;
+};
+
+// How a language is highlighted. Comment markers take one or two characters, and a two character line
+// comment marker has to start like the block comment one.
+struct syntax_rules {
+    const char **extensions, **keywords, **types; // NULL terminated.
+    const char *line_comment, *block_start, *block_end, *quotes;
+};
+
+// Rules compiled to a transition table with one row per lexer state and one column per byte, so that
+// going through a row takes a lookup per byte.
+struct syntax {
+    const struct syntax_rules *rules; // NULL for plain text, where only digits stand out.
+    unsigned char next[LEX_STATES][256];
+    unsigned char highlight[LEX_STATES]; // Color of a byte that leaves the lexer in this state.
+    unsigned char back[LEX_STATES]; // Set where the byte before turns out to take the same color.
+    unsigned char line_end[LEX_STATES]; // State the next row starts in.
+    int multiline; // Whether a row can start in anything but LEX_NORMAL.
+    const char *words[KEYWORD_SLOTS]; // Keywords and types, hashed.
+    unsigned char word_highlight[KEYWORD_SLOTS];
+};
+
+struct match {
+    int row, col;
+};
+
+struct matches {
+    struct match *match;
+    int count, capacity;
+};
+
+// State shared by the workers of one search.
+struct search {
+    regex_t *compiled; // NULL when the pattern is a plain string.
+    char *literal;
+    int literal_size;
+    unsigned int *trigrams; // Hashes a chunk must hold to possibly match.
+    int trigram_count;
+    int *rows; // Rows to look at, or NULL for a range of the document.
+    int first, row_count, rows_per_task;
+    struct matches *results;
+};
+
+// The thread building the trigram index. It's started once and sent over the document again whenever
+// chunks may have lost their bitmaps.
+struct indexer {
+    pthread_cond_t start;
+    int started;
+    int pending; // Go over the document from the top.
+};
+
+// The search of EC.search going through the document in the background, a slice of rows at a time. Rows
+// before next have their matches in EC.matches, kept up to date through edits like any search's.
+struct finding {
+    pthread_cond_t start;
+    int started; // The thread is there, waiting for searches.
+    int running;
+    int stopped; // Cancelled before it got to the end, so the matches are only those before next.
+    int next;
+    int jump; // Move the cursor to the first match once one turns up.
+    int report; // Tell how many matches there are once done.
+};
+
+// A row rebuilt by a replace, waiting to be swapped into the document.
+struct replaced {
+    int row, count; // Occurrences replaced in it.
+    char *content; // Heap block the row owns once swapped in.
+    int size;
+};
+
+// What one task of a replace rebuilt, and the scratch space it did it in.
+struct replace_task {
+    struct replaced *rows;
+    int count, capacity;
+    char *scratch;
+    size_t scratch_size, scratch_capacity;
+};
+
+// State shared by the workers of one replace.
+struct replace {
+    struct search search;
+    char *replacement;
+    int limit; // Most occurrences to replace, which is also the most any one task looks for.
+    struct replace_task *tasks;
+};
+
+// A row as the line transforms see it: where it is, and the number it starts with when sorting by that.
+struct line {
+    document_row *row;
+    int index;
+    double number;
+};
+
+// State shared by the workers of one line transform.
+struct transform {
+    struct line *lines, *merged; // Sorted runs are merged from one into the other.
+    int count, lines_per_task, run;
+    int numeric, reverse;
+    struct search search; // Pattern rows are kept or dropped by.
+    int keep;
+    unsigned char *kept;
+};
+
+// Bytes read from the terminal but not turned into keys yet, so bursts of input such as pastes take
+// one read call rather than one per byte.
+struct input {
+    char bytes[4096];
+    int size, next;
+};
+
+struct paste {
+    char *text;
+    size_t size, capacity;
+};
+
+// What the stats overlay and command report.
+struct stats {
+    double frame_time, frame_times[STATS_FRAMES]; // Milliseconds the latest refresh_screen calls took.
+    long long frames;
+    int frame_bytes; // Sent to the terminal by the last frame.
+    long long row_bytes, render_bytes, highlight_bytes, cache_bytes; // Heap held by each part of the rows.
+    double load_time, find_time;
+    int find_rows; // Rows the last search went through.
+    int overlay; // Shown in place of the message bar.
+};
+
+// A file being watched for lines appended to it, like tail -F does.
+struct follow {
+    int inotify; // -1 when not following.
+    int file_watch, directory_watch; // The directory tells when a new file takes the old one's place.
+    int fd;
+    off_t offset; // Bytes of the file that are in the document, known even when not following.
+    int open_row; // The last row wasn't finished by a line break yet.
+};
+
 struct editor_config {
+    int terminal_in, terminal_out; // Where keys come from and frames go, usually stdin and stdout.
     int cursor_x, cursor_y;
+    int render_x; // Screen column of the cursor in its row, past cursor_x when there are tabs before it.
     int rows, cols;
     int row_offset, col_offset;
     int document_rows;
-    document_row *row;
+    row_node *row;
     char *file_name;
-    char status[80];
+    char *map;
+    int map_fd; // Kept open to copy unchanged bytes from when saving, -1 once the mapping is detached.
+    size_t map_size, load_progress; // Bytes of the mapping turned into rows so far.
+    struct timespec map_time;
+    size_t map_lost; // Offset of the first page the file took away under the mapping, found by a fault.
+    size_t page_size;
+    char status[160];
     time_t status_time;
     int mode;
+    struct screen screen;
+    struct buffer frame;
+    struct workers workers;
+    pthread_mutex_t lock; // Held by the editor except while it waits for input.
+    pthread_cond_t loaded; // Signalled whenever the background loader adds rows.
+    int loading; // Set while rows are still being added by the background loader.
+    int streaming; // Set while rows come from a pipe, which may never end, so nothing waits for it.
+    struct search search; // Last search, kept along with its matches to move between them.
+    struct matches matches;
+    struct finding finding;
+    struct indexer indexer;
+    struct input input;
+    struct paste paste;
+    int wake[2]; // Self-pipe that gets the editor out of waiting for input to redraw.
+    int redraw_pending; // A wake-up is already on its way.
+    volatile sig_atomic_t resized;
+    struct stats stats;
+    struct follow follow;
+    struct syntax syntax;
+    int *syntax_dirty; // Rows whose end state may be out of date, sorted. Rows before them are right.
+    int syntax_dirty_count, syntax_dirty_capacity;
+    int *rendered; // Rows holding a render, highlight or row_cache, sorted. Only a few screens' worth.
+    int rendered_count, rendered_capacity;
+    struct render_buffers *spare; // Let go of by rows that stopped being shown, still counted as held.
+    int spare_count, spare_capacity;
     struct termios initial_state;
 };
 
@@ -67,319 +409,2026 @@ struct editor_config EC;
 
 /*** Utils ***/
 void clear_and_reposition_cursor() {
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+    write(EC.terminal_out, "\x1b[2J", 4);
+    write(EC.terminal_out, "\x1b[H", 3);
 }
 
 /*** Prototypes ***/
-void row_append_render(document_row *row);
+void row_append_render(document_row *row, int from, int to);
+
+int row_render_x(document_row *row, int x);
+
+unsigned char row_state_at(document_row *row, unsigned char state, int x);
+
+size_t content_capacity(size_t size);
+
+void row_prepare(document_row *row, unsigned char state);
+
+void row_release(document_row *row);
 
 void insert_char(int c);
 
 void insert_new_line();
 
+void insert_text(char *text, size_t size);
+
 void refresh_screen();
 
 void delete_char();
 
 void save_file();
 
-/*** Buffer printer ***/
-struct buffer {
-    char *content;
-    int size;
-};
+void rows_end(row_node **chunk);
 
-void buffer_append(struct buffer *buff, const char *s, int size) {
-    char *new_content = realloc(buff->content, buff->size + size);
+void load_wait(int rows);
 
-    if (!new_content) return;
-    memcpy(&new_content[buff->size], s, size);
-    buff->content = new_content;
-    buff->size += size;
-}
+void open_stream(int fd);
 
-void buffer_drop(struct buffer *buff) {
-    free(buff->content);
-}
+void index_row(int i);
 
-/*** Functions ***/
-void editor_exit(const char *s) {
-    clear_and_reposition_cursor();
+void search_row_changed(int i);
 
-    perror(s);
-    exit(1);
-}
+void syntax_invalidate(int i);
 
-void editor_disable() {
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &EC.initial_state) == -1) editor_exit("tcsetattr");
-}
+void syntax_select(char *file_name);
 
-void editor_enable() {
-    if (tcgetattr(STDIN_FILENO, &EC.initial_state) == -1) editor_exit("tcgetattr");
-    atexit(editor_disable);
+void follow_update();
 
-    struct termios raw = EC.initial_state;
+void follow_toggle();
 
-    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-    raw.c_oflag &= ~(OPOST);
-    raw.c_cflag |= (CS8);
-    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-    raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+void replace(char *pattern, char *replacement, int limit);
 
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) editor_exit("tcsetattr");
-}
+void lines_sort(int numeric, int reverse);
 
-int read_key() {
-    int read_no;
-    char c;
+void lines_uniq();
 
-    while ((read_no = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (read_no == -1 && errno != EAGAIN) editor_exit("read");
-    }
+void lines_filter(char *pattern, int keep);
 
-    // Process arrow key sequence to determine cursor direction.
-    if (c == '\x1b') {
-        char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-        if (seq[0] == '[') {
-            if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-                if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '1':
-                            return HOME_KEY;
-                        case '3':
-                            return DEL_KEY;
-                        case '4':
-                            return END_KEY;
-                        case '5':
-                            return PAGE_UP;
-                        case '6':
-                            return PAGE_DOWN;
-                        case '7':
-                            return HOME_KEY;
-                        case '8':
-                            return END_KEY;
-                    }
-                }
-            } else {
-                switch (seq[1]) {
-                    case 'A':
-                        return UP;
-                    case 'B':
-                        return DOWN;
-                    case 'C':
-                        return RIGHT;
-                    case 'D':
-                        return LEFT;
-                    case 'H':
-                        return HOME_KEY;
-                    case 'F':
-                        return END_KEY;
-                }
-            }
-        } else if (seq[0] == 'O') {
-            switch (seq[1]) {
-                case 'H':
-                    return HOME_KEY;
-                case 'F':
-                    return END_KEY;
-            }
-        }
+int lines_ready();
 
-        return '\x1b';
-    } else {
-        return c;
-    }
-}
+void node_fill(row_node *node);
 
-int cursor_position(int *rows, int *cols) {
-    char buf[32];
-    unsigned int i = 0;
-    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
-    while (i < sizeof(buf) - 1) {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
-        if (buf[i] == 'R') break;
-        i++;
-    }
+void editor_wake();
 
-    buf[i] = '\0';
-    if (buf[0] != '\x1b' || buf[1] != '[') return -1;
-    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) return -1;
+int window_size(int *rows, int *cols);
 
-    return 0;
-}
+void set_status(const char *fmt, ...);
 
-int window_size(int *rows, int *cols) {
-    struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-        return cursor_position(rows, cols);
-    } else {
-        *cols = ws.ws_col;
-        *rows = ws.ws_row;
-        return 0;
-    }
-}
+void map_check();
 
-void editor_init() {
-    EC.cursor_x = 0;
-    EC.cursor_y = 0;
-    EC.row_offset = 0;
-    EC.col_offset = 0;
-    EC.document_rows = 0;
-    EC.row = NULL;
-    EC.file_name = NULL;
-    EC.status[0] = '\0';
-    EC.status_time = 0;
-    EC.mode = READ_MODE;
+int lines_collect(struct transform *transform);
 
-    if (window_size(&EC.rows, &EC.cols) == -1) editor_exit("window_size");
-    EC.rows -= 2; // Leave space for status bar and status messages.
-}
+void lines_compact(struct transform *transform);
 
-/*** Syntax highlighting functions ***/
-void row_set_syntax(document_row *row) {
-    row->highlight = realloc(row->highlight, row->render_size);
-    memset(row->highlight, HL_DEFAULT, row->render_size);
+void lines_rebuild(struct transform *transform);
 
-    for (int i = 0; i < row->render_size; ++i) {
-        if (isdigit(row->render_content[i])) {
-            row->highlight[i] = HL_NUMBER;
+/*** Buffer printer ***/
+// Starts a new arena block at least twice as big as the last one, keeping the old one alive until the
+// frame is flushed since the pending iovecs still point into it.
+void buffer_grow(struct buffer *buff, int size) {
+    if (buff->content) {
+        if (buff->spent_count == buff->spent_capacity) {
+            buff->spent_capacity = buff->spent_capacity ? buff->spent_capacity * 2 : 8;
+            buff->spent = realloc(buff->spent, sizeof(char *) * buff->spent_capacity);
         }
+        buff->spent[buff->spent_count++] = buff->content;
     }
+
+    int capacity = buff->capacity ? buff->capacity * 2 : 4096;
+    while (capacity < size) capacity *= 2;
+    buff->content = malloc(capacity);
+    buff->capacity = capacity;
+    buff->size = 0;
 }
 
-int syntax_to_color_code(int highlight) {
-    switch (highlight) {
-        case HL_NUMBER:
-            return 31;
-        default:
-            return 39;
+void buffer_push(struct buffer *buff, const char *s, int size) {
+    struct iovec *last = buff->iov_count ? &buff->iov[buff->iov_count - 1] : NULL;
+    if (last && (const char *) last->iov_base + last->iov_len == s) {
+        last->iov_len += size;
+        return;
     }
-}
 
-/*** Output functions ***/
-void scroll_window() {
-    if (EC.cursor_y < EC.row_offset) // Check if cursor above visible window and scroll up
-        EC.row_offset = EC.cursor_y;
-    if (EC.cursor_y >= EC.row_offset + EC.rows) // Check if cursor below visible window and scroll down
-        EC.row_offset = EC.cursor_y - EC.rows + 1;
-    if (EC.cursor_x < EC.col_offset)
-        EC.col_offset = EC.cursor_x;
-    if (EC.cursor_x >= EC.col_offset + EC.cols)
-        EC.col_offset = EC.cursor_x - EC.cols + 1;
+    if (buff->iov_count == buff->iov_capacity) {
+        buff->iov_capacity = buff->iov_capacity ? buff->iov_capacity * 2 : 64;
+        buff->iov = realloc(buff->iov, sizeof(struct iovec) * buff->iov_capacity);
+    }
+    buff->iov[buff->iov_count].iov_base = (void *) s;
+    buff->iov[buff->iov_count++].iov_len = size;
 }
 
-void set_status(const char *fmt, ...) {
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(EC.status, sizeof(EC.status), fmt, ap);
-    va_end(ap);
-    EC.status_time = time(NULL);
-}
+void buffer_append(struct buffer *buff, const char *s, int size) {
+    if (size <= 0) return;
+    if (buff->size + size > buff->capacity) buffer_grow(buff, size);
 
-void draw_rows(struct buffer *buff) {
-    for (int r = 0; r < EC.rows; ++r) {
-        int i = r + EC.row_offset;
-        if (i >= EC.document_rows) {
-            buffer_append(buff, "~", 1);
-        } else {
-            int size = EC.row[i].render_size - EC.col_offset;
-            if (size < 0) size = 0;
-            if (size > EC.cols) size = EC.cols;
+    char *destination = &buff->content[buff->size];
+    memcpy(destination, s, size);
+    buff->size += size;
+    buffer_push(buff, destination, size);
+}
 
-            char *c = &EC.row[i].render_content[EC.col_offset];
-            unsigned char *highlight = &EC.row[i].highlight[EC.col_offset];
-            int current_color = -1;
-            for (int j = 0; j < size; ++j) {
-                if (highlight[j] == HL_DEFAULT) { // Color numbers in red
-                    if (current_color != -1) {
-                        current_color = -1;
-                        buffer_append(buff, "\x1b[39m", 5);
-                    }
-                    buffer_append(buff, &c[j], 1);
-                } else {
-                    int color = syntax_to_color_code(highlight[j]);
-                    if (color != current_color) {
-                        current_color = color;
-                        char line[16];
-                        int line_size = snprintf(line, sizeof(line), "\x1b[%dm", color);
-                        buffer_append(buff, line, line_size);
-                    }
-                    buffer_append(buff, &c[j], 1);
-                }
-                buffer_append(buff, "\x1b[39m", 5);
-            }
-        }
+// Queues bytes without copying them. They must stay valid and unchanged until the next flush.
+void buffer_reference(struct buffer *buff, const char *s, int size) {
+    if (size < 64) buffer_append(buff, s, size); // Not worth an iovec of its own.
+    else if (size > 0) buffer_push(buff, s, size);
+}
 
-        buffer_append(buff, "\x1b[K", 3);
-        buffer_append(buff, "\r\n", 2);
-    }
+int buffer_length(struct buffer *buff) {
+    int length = 0;
+    for (int i = 0; i < buff->iov_count; ++i)
+        length += buff->iov[i].iov_len;
+    return length;
 }
 
-void draw_message_bar(struct buffer *buff) {
-    buffer_append(buff, "\x1b[K", 3);
-    int size = strlen(EC.status);
-    if (size > EC.cols) size = EC.cols;
-    if (size && time(NULL) - EC.status_time < 5)
-        buffer_append(buff, EC.status, size);
+// Empties the frame. Blocks outgrown during it are folded into a single one big enough for all of them,
+// which is at most twice the last since each block doubles the previous one. A frame of the same size
+// then never allocates again.
+void buffer_reset(struct buffer *buff) {
+    if (buff->spent_count) {
+        for (int i = 0; i < buff->spent_count; ++i)
+            free(buff->spent[i]);
+        buff->spent_count = 0;
+        free(buff->content);
+        buff->capacity *= 2;
+        buff->content = malloc(buff->capacity);
+    }
+    buff->size = 0;
+    buff->iov_count = 0;
 }
 
-void draw_status_bar(struct buffer *buff) {
-    buffer_append(buff, "\x1b[7m", 4); // Invert colors
+// Writes the whole frame with as few writev calls as possible, resuming after partial writes.
+int buffer_flush(struct buffer *buff, int fd) {
+    struct iovec *iov = buff->iov;
+    int count = buff->iov_count, error = 0;
 
-    char status[80], *mode;
-    switch (EC.mode) {
-        case READ_MODE:
-            mode = stringify(READ_MODE);
-            break;
-        case EDIT_MODE:
-            mode = stringify(EDIT_MODE);
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count > IOV_MAX ? IOV_MAX : count);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            error = -1;
             break;
+        }
+        while (count > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
     }
-    int cols = snprintf(
-            status,
-            sizeof(status),
-            " %.20s - %d lines [%s]",
-            EC.file_name ? EC.file_name : "[New document]",
-            EC.document_rows,
-            mode
-    );
-
-    if (cols > EC.cols) cols = EC.cols;
-    buffer_append(buff, status, cols);
-    while (++cols < EC.cols)
-        buffer_append(buff, " ", 1);
-    buffer_append(buff, "\x1b[m", 3);
-    buffer_append(buff, "\r\n", 2);
+    buffer_reset(buff);
+    return error;
 }
 
-void refresh_screen() {
-    scroll_window();
-    struct buffer buff = BUFFER_INIT;
+void buffer_free(struct buffer *buff) {
+    buffer_reset(buff);
+    free(buff->content);
+    free(buff->spent);
+    free(buff->iov);
+}
 
-    buffer_append(&buff, "\x1b[?25l", 6);
-    buffer_append(&buff, "\x1b[H", 3);
+/*** Stats ***/
+#ifndef RED_NO_STATS
+double stats_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
 
-    draw_rows(&buff);
-    draw_status_bar(&buff);
-    draw_message_bar(&buff);
+int stats_compare(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
 
-    char cursor_buff[32];
-    snprintf(cursor_buff, sizeof(cursor_buff), "\x1b[%d;%dH", (EC.cursor_y - EC.row_offset) + 1,
-             (EC.cursor_x - EC.col_offset) + 1);
-    buffer_append(&buff, cursor_buff, strlen(cursor_buff));
-    buffer_append(&buff, "\x1b[?25h", 6);
+// Records a frame that was timed with STAT_START(frame_time).
+void stats_frame(int bytes) {
+    STAT_STOP(frame_time);
+    EC.stats.frame_times[EC.stats.frames++ % STATS_FRAMES] = EC.stats.frame_time;
+    EC.stats.frame_bytes = bytes;
+}
 
-    write(STDOUT_FILENO, buff.content, buff.size);
-    buffer_drop(&buff);
+double stats_megabytes(long long *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED) / 1048576.0;
+}
+
+// Sums up the latest figures in a line for the message bar.
+void stats_describe(char *line, size_t size) {
+    struct stats *stats = &EC.stats;
+    double frames[STATS_FRAMES];
+    int count = stats->frames < STATS_FRAMES ? stats->frames : STATS_FRAMES;
+    memcpy(frames, stats->frame_times, sizeof(double) * count);
+    qsort(frames, count, sizeof(double), stats_compare);
+
+    double last = count ? stats->frame_times[(stats->frames - 1) % STATS_FRAMES] : 0;
+    double p99 = count ? frames[(count * 99 + 99) / 100 - 1] : 0;
+    char load[32] = "-";
+    if (EC.loading) snprintf(load, sizeof(load), "running");
+    else if (EC.map_size && stats->load_time > 0)
+        snprintf(load, sizeof(load), "%.0fMB/s", EC.map_size / 1048576.0 / (stats->load_time / 1e3));
+
+    snprintf(line, size, "frame %.2fms p99 %.2fms %dB | heap rows %.1fM render %.1fM highlight %.1fM "
+                         "cache %.1fM | load %s | find %.2fms over %d rows",
+             last, p99, stats->frame_bytes, stats_megabytes(&stats->row_bytes), stats_megabytes(&stats->render_bytes),
+             stats_megabytes(&stats->highlight_bytes), stats_megabytes(&stats->cache_bytes), load,
+             stats->find_time, stats->find_rows);
+}
+#endif
+
+// Shows the figures once, in the message bar.
+void stats_report() {
+#ifndef RED_NO_STATS
+    char line[sizeof(EC.status)];
+    stats_describe(line, sizeof(line));
+    set_status("%s", line);
+#else
+    set_status("Stats were left out of this build");
+#endif
+}
+
+void stats_toggle() {
+#ifndef RED_NO_STATS
+    EC.stats.overlay = !EC.stats.overlay;
+#else
+    stats_report();
+#endif
+}
+
+/*** Row store ***/
+int node_rows(row_node *node) {
+    return node ? node->rows : 0;
+}
+
+void node_update(row_node *node) {
+    node->rows = node_rows(node->left) + node->size + node_rows(node->right);
+}
+
+row_node *node_new() {
+    static unsigned int seed = 2463534242u;
+    row_node *node = malloc(sizeof(row_node));
+    STAT_HELD(row_bytes, node);
+
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    node->left = node->right = NULL;
+    node->priority = seed;
+    node->rows = node->size = 0;
+    node->trigrams = NULL;
+    node->text = NULL;
+    return node;
+}
+
+row_node *node_merge(row_node *a, row_node *b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (a->priority > b->priority) {
+        a->right = node_merge(a->right, b);
+        node_update(a);
+        return a;
+    }
+    b->left = node_merge(a, b->left);
+    node_update(b);
+    return b;
+}
+
+// Splits the first k rows off into *left. k must fall on a chunk boundary.
+void node_split(row_node *node, int k, row_node **left, row_node **right) {
+    if (!node) {
+        *left = *right = NULL;
+        return;
+    }
+
+    int left_rows = node_rows(node->left);
+    if (k <= left_rows) {
+        node_split(node->left, k, left, &node->left);
+        *right = node;
+    } else {
+        node_split(node->right, k - left_rows - node->size, &node->right, right);
+        *left = node;
+    }
+    node_update(node);
+}
+
+// Finds the chunk holding row i and the index of its first row. When inclusive, a position right
+// after the last row of a chunk also counts as part of it, which is what insertions need. Chunks only
+// known from a line index get their rows built on the way, so callers must hold the document lock.
+row_node *node_find(int i, int *start, int inclusive) {
+    row_node *node = EC.row;
+    *start = 0;
+    while (node) {
+        int left_rows = node_rows(node->left);
+        if (i < left_rows) {
+            node = node->left;
+        } else if (i - left_rows < node->size + inclusive) {
+            *start += left_rows;
+            if (node->text) node_fill(node);
+            return node;
+        } else {
+            *start += left_rows + node->size;
+            i -= left_rows + node->size;
+            node = node->right;
+        }
+    }
+    return NULL;
+}
+
+// Detaches the chunk holding row i from the tree, leaving the chunks before and after it in *left
+// and *right. Callers put it back with node_merge once they're done changing it.
+row_node *node_take(int i, int inclusive, int *start, row_node **left, row_node **right) {
+    row_node *node = node_find(i, start, inclusive), *middle;
+    node_split(EC.row, *start, left, right);
+    node_split(*right, node->size, &middle, right);
+    return middle;
+}
+
+// Returns row i and, through count, how many rows follow it contiguously in memory.
+document_row *row_span(int i, int *count) {
+    int start;
+    row_node *node = (i >= 0 && i < node_rows(EC.row)) ? node_find(i, &start, 0) : NULL;
+
+    if (!node) return NULL;
+    if (count) *count = node->size - (i - start);
+    return &node->row[i - start];
+}
+
+document_row *row_at(int i) {
+    return row_span(i, NULL);
+}
+
+// Opens up an uninitialized slot for a new row at position i.
+document_row *row_insert(int i) {
+    if (i < 0 || i > node_rows(EC.row)) return NULL;
+
+    int start = 0;
+    row_node *left = NULL, *right = NULL;
+    row_node *node = EC.row ? node_take(i, 1, &start, &left, &right) : node_new(), *next = NULL;
+    row_node *target = node;
+    int offset = i - start;
+
+    if (node->size == ROW_CHUNK) { // Split full chunks in half, or start a new one when appending to them.
+        next = node_new();
+        if (node->trigrams) next->trigrams = calloc(1, TRIGRAM_BYTES);
+        if (offset < ROW_CHUNK) {
+            if (next->trigrams) memcpy(next->trigrams, node->trigrams, TRIGRAM_BYTES);
+            next->size = ROW_CHUNK / 2;
+            memcpy(next->row, &node->row[ROW_CHUNK - next->size], sizeof(document_row) * next->size);
+            node->size -= next->size;
+        }
+        if (offset > node->size || node->size == ROW_CHUNK) {
+            offset -= node->size;
+            target = next;
+        }
+    }
+
+    memmove(&target->row[offset + 1], &target->row[offset], sizeof(document_row) * (target->size - offset));
+    ++target->size;
+    node_update(node);
+    if (next) node_update(next);
+    EC.row = node_merge(node_merge(left, node_merge(node, next)), right);
+    return &target->row[offset];
+}
+
+// Drops row i from the store. The row itself must have been freed already.
+void row_remove(int i) {
+    if (i < 0 || i >= node_rows(EC.row)) return;
+
+    int start;
+    row_node *left, *right;
+    row_node *node = node_take(i, 0, &start, &left, &right);
+    int offset = i - start;
+
+    memmove(&node->row[offset], &node->row[offset + 1], sizeof(document_row) * (node->size - offset - 1));
+    --node->size;
+    if (node->size == 0) {
+        free(node->trigrams);
+        STAT_RELEASED(row_bytes, node);
+        free(node);
+        node = NULL;
+    } else {
+        node_update(node);
+    }
+    EC.row = node_merge(node_merge(left, node), right);
+}
+
+// Hands out slots at the end of the document a chunk at a time, so loading doesn't walk the tree for
+// every row. The chunk being filled only joins the document, rows included, in rows_end.
+document_row *rows_next(row_node **chunk) {
+    if (*chunk && (*chunk)->size == ROW_CHUNK) rows_end(chunk);
+    if (!*chunk) *chunk = node_new();
+    return &(*chunk)->row[(*chunk)->size++];
+}
+
+// The background loader is the only one adding rows while EC.loading is set, so it takes the document
+// lock just to publish them.
+void rows_end(row_node **chunk) {
+    if (!*chunk) return;
+    int loading = EC.loading, i = EC.document_rows;
+    if (loading) pthread_mutex_lock(&EC.lock);
+
+    document_row *last = &(*chunk)->row[(*chunk)->size - 1];
+    if (last->flags & ROW_BORROWED) EC.load_progress = last->content + last->size - EC.map;
+    if (EC.row && (*chunk)->size < ROW_CHUNK / 2) { // A few rows at a time off a pipe fill up the last chunk.
+        for (int k = 0; k < (*chunk)->size; ++k)
+            *row_insert(i + k) = (*chunk)->row[k];
+        EC.document_rows += (*chunk)->size;
+        STAT_RELEASED(row_bytes, *chunk);
+        free(*chunk);
+    } else {
+        node_update(*chunk);
+        EC.row = node_merge(EC.row, *chunk);
+        EC.document_rows += (*chunk)->size;
+    }
+    syntax_invalidate(i);
+    for (; i < EC.document_rows; ++i) { // Also look for the last search in them.
+        index_row(i);
+        search_row_changed(i);
+    }
+    *chunk = NULL;
+
+    if (loading) {
+        pthread_cond_broadcast(&EC.loaded);
+        if (!EC.redraw_pending) { // Have the new rows shown, once however many come before the redraw.
+            EC.redraw_pending = 1;
+            editor_wake();
+        }
+        pthread_mutex_unlock(&EC.lock);
+    }
+}
+
+/*** Workers ***/
+// Runs the tasks of the current job, claiming them one at a time. Called with the pool lock held.
+void workers_drain(int worker) {
+    struct workers *workers = &EC.workers;
+    while (workers->next < workers->tasks) {
+        int task = workers->next++;
+        pthread_mutex_unlock(&workers->lock);
+        workers->task(task, worker, workers->context);
+        pthread_mutex_lock(&workers->lock);
+        if (--workers->pending == 0) pthread_cond_signal(&workers->done);
+    }
+}
+
+void *worker_main(void *argument) {
+    struct workers *workers = &EC.workers;
+    int worker = (int) (intptr_t) argument, generation = 0;
+
+    pthread_mutex_lock(&workers->lock);
+    while (1) {
+        while (workers->generation == generation)
+            pthread_cond_wait(&workers->wake, &workers->lock);
+        generation = workers->generation;
+        workers_drain(worker);
+    }
+    return NULL;
+}
+
+// Number of threads a job is spread over, the caller included.
+int workers_size() {
+    struct workers *workers = &EC.workers;
+    if (workers->size) return workers->size;
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    workers->size = cores < 1 ? 1 : cores > 64 ? 64 : cores;
+    pthread_mutex_init(&workers->lock, NULL);
+    pthread_cond_init(&workers->wake, NULL);
+    pthread_cond_init(&workers->done, NULL);
+    for (int i = 1; i < workers->size; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_main, (void *) (intptr_t) i) != 0) {
+            workers->size = i;
+            break;
+        }
+        pthread_detach(thread);
+    }
+    return workers->size;
+}
+
+// Calls task(i, worker, context) for every i below tasks across the pool and waits for all of them.
+// worker identifies the thread running the task, from 0 (the caller) to workers_size() - 1.
+void workers_run(int tasks, void (*task)(int task, int worker, void *context), void *context) {
+    struct workers *workers = &EC.workers;
+    workers_size();
+
+    pthread_mutex_lock(&workers->lock);
+    workers->task = task;
+    workers->context = context;
+    workers->tasks = workers->pending = tasks;
+    workers->next = 0;
+    ++workers->generation;
+    pthread_cond_broadcast(&workers->wake);
+
+    workers_drain(0);
+    while (workers->pending)
+        pthread_cond_wait(&workers->done, &workers->lock);
+    pthread_mutex_unlock(&workers->lock);
+}
+
+/*** Trigram index ***/
+// Every chunk of rows can carry a bitmap of the trigrams found in it: a trigram index kept at chunk
+// granularity. Bits are only ever added while editing, so a bitmap may claim trigrams a chunk lost but
+// never misses one it has, and a chunk lacking any trigram of a query can be skipped unread.
+unsigned int trigram_hash(const char *s) {
+    unsigned int trigram = (unsigned char) s[0] << 16 | (unsigned char) s[1] << 8 | (unsigned char) s[2];
+    return (trigram * 2654435761u) >> (32 - TRIGRAM_HASH_BITS);
+}
+
+void trigrams_add(unsigned char *trigrams, const char *s, int size) {
+    for (int j = 0; j + 2 < size; ++j) {
+        unsigned int hash = trigram_hash(&s[j]);
+        trigrams[hash >> 3] |= 1 << (hash & 7);
+    }
+}
+
+// Tells whether a chunk may hold every one of the given trigram hashes.
+int trigrams_contain(unsigned char *trigrams, unsigned int *hashes, int count) {
+    for (int j = 0; j < count; ++j)
+        if (!(trigrams[hashes[j] >> 3] & (1 << (hashes[j] & 7)))) return 0;
+    return 1;
+}
+
+void index_chunk(row_node *node) {
+    if (!node->trigrams) node->trigrams = calloc(1, TRIGRAM_BYTES);
+    for (int j = 0; j < node->size; ++j)
+        trigrams_add(node->trigrams, node->row[j].content, node->row[j].size);
+}
+
+// Records the trigrams of row i after its content changed, if its chunk is indexed already.
+void index_row(int i) {
+    int start;
+    row_node *node = (i >= 0 && i < EC.document_rows) ? node_find(i, &start, 0) : NULL;
+    if (node && node->trigrams) trigrams_add(node->trigrams, node->row[i - start].content, node->row[i - start].size);
+}
+
+// Indexes one chunk at a time, holding the document lock only while doing so. Edits can move chunks
+// around while the lock is released, so passes repeat until one finds nothing left to index. Being
+// asked to start over sends it back to the top.
+void *index_main(void *argument) {
+    struct indexer *indexer = &EC.indexer;
+    (void) argument;
+
+    pthread_mutex_lock(&EC.lock);
+    while (1) {
+        while (!indexer->pending)
+            pthread_cond_wait(&indexer->start, &EC.lock);
+        load_wait(INT_MAX);
+
+        for (int i = 0, indexed = 0;;) {
+            if (indexer->pending) {
+                indexer->pending = 0;
+                i = indexed = 0;
+            }
+            if (i >= EC.document_rows) {
+                if (!indexed) break;
+                i = indexed = 0;
+                continue;
+            }
+
+            int start;
+            row_node *node = node_find(i, &start, 0);
+            if (!node->trigrams) {
+                index_chunk(node);
+                indexed = 1;
+            }
+            i = start + node->size;
+            pthread_mutex_unlock(&EC.lock);
+            sched_yield(); // Let the editor take the lock between chunks.
+            pthread_mutex_lock(&EC.lock);
+        }
+    }
+    return NULL;
+}
+
+void index_start() {
+    struct indexer *indexer = &EC.indexer;
+    indexer->pending = 1;
+    if (!indexer->started) {
+        pthread_t thread;
+        pthread_cond_init(&indexer->start, NULL);
+        indexer->started = pthread_create(&thread, NULL, index_main, NULL) == 0;
+        if (indexer->started) pthread_detach(thread);
+    }
+    pthread_cond_signal(&indexer->start);
+}
+
+// Extracts the longest run of characters every match of a basic regular expression must contain.
+// Gives up on backslashes, which may introduce alternations, groups or intervals.
+int pattern_required_literal(char *pattern, char *literal) {
+    int best = 0, size = 0, length = strlen(pattern);
+    char run[length + 1];
+
+    for (int i = 0; i <= length; ++i) {
+        char c = pattern[i];
+        if (c == '\\') return 0;
+        if (c && !strchr(".[*^$", c)) {
+            run[size++] = c;
+            continue;
+        }
+
+        if (c == '*' && size) --size; // The starred character may be missing.
+        if (size > best) memcpy(literal, run, best = size);
+        size = 0;
+        if (c == '[') { // A bracket expression matches one of many characters. ']' first is literal.
+            i += pattern[i + 1] == '^' ? 2 : 1;
+            if (pattern[i] == ']') ++i;
+            while (pattern[i] && pattern[i] != ']') {
+                if (pattern[i] == '[' && pattern[i + 1] && strchr(":=.", pattern[i + 1])) { // [:class:] and alike.
+                    char *end = strstr(&pattern[i + 2], (char[]) {pattern[i + 1], ']', '\0'});
+                    if (!end) return 0;
+                    i = end - pattern + 1;
+                }
+                ++i;
+            }
+            if (!pattern[i]) return 0;
+            if (pattern[i + 1] == '*') ++i;
+        }
+    }
+    literal[best] = '\0';
+    return best;
+}
+
+/*** Functions ***/
+void editor_exit(const char *s) {
+    clear_and_reposition_cursor();
+
+    perror(s);
+    exit(1);
+}
+
+// Runs on the way out, from atexit too, so there's nothing left to do about a failure but carry on.
+void editor_disable() {
+    write(EC.terminal_out, "\x1b[?2004l", 8);
+    tcsetattr(EC.terminal_in, TCSAFLUSH, &EC.initial_state);
+}
+
+void editor_enable(int in, int out) {
+    EC.terminal_in = in;
+    EC.terminal_out = out;
+    if (tcgetattr(EC.terminal_in, &EC.initial_state) == -1) editor_exit("tcgetattr");
+    atexit(editor_disable);
+
+    struct termios raw = EC.initial_state;
+
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_oflag &= ~(OPOST);
+    raw.c_cflag |= (CS8);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 0; // Reads never block, waiting is up to poll.
+    raw.c_cc[VTIME] = 0;
+
+    if (tcsetattr(EC.terminal_in, TCSAFLUSH, &raw) == -1) editor_exit("tcsetattr");
+    if (write(EC.terminal_out, "\x1b[?2004h", 8) != 8) editor_exit("write"); // Have pastes bracketed.
+}
+
+// Makes sure there is input to take, waiting up to timeout milliseconds for it. Returns 0 if none came.
+int input_fill(int timeout) {
+    struct input *input = &EC.input;
+    if (input->next < input->size) return 1;
+
+    struct pollfd terminal = {EC.terminal_in, POLLIN, 0};
+    if (poll(&terminal, 1, timeout) <= 0) return 0;
+    ssize_t size = read(EC.terminal_in, input->bytes, sizeof(input->bytes));
+    if (size == -1 && errno != EAGAIN && errno != EINTR) editor_exit("read");
+    if (size == 0) exit(0); // The terminal is gone.
+    input->next = 0;
+    input->size = size > 0 ? size : 0;
+    return size > 0;
+}
+
+// Takes the next byte of an escape sequence, or -1 when it doesn't follow quickly enough.
+int input_byte() {
+    return input_fill(ESCAPE_WAIT) ? (unsigned char) EC.input.bytes[EC.input.next++] : -1;
+}
+
+int input_pending() {
+    return EC.input.next < EC.input.size;
+}
+
+// Gets the editor out of waiting for input. Safe from signal handlers and other threads.
+void editor_wake() {
+    int saved = errno; // Signal handlers must leave errno alone.
+    ssize_t written = EC.wake[1] ? write(EC.wake[1], "", 1) : 0; // Only fails when full, so already awake.
+    (void) written;
+    errno = saved;
+}
+
+void handle_resize(int signal) {
+    (void) signal;
+    EC.resized = 1;
+    editor_wake();
+}
+
+// A row touched a page of the mapping the file doesn't have any more, as it was cut short from outside.
+// Zeros are mapped from there on for the access to go on with, and the editor drops the rows that lived
+// there once it wakes up. Faults anywhere else are left to kill the editor as they would.
+void handle_fault(int signal, siginfo_t *info, void *context) {
+    char *address = info->si_addr, *page;
+    (void) context;
+    if (EC.map && address >= EC.map && address < EC.map + EC.map_size) {
+        page = EC.map + (address - EC.map) / EC.page_size * EC.page_size;
+        if (mmap(page, EC.map + EC.map_size - page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) !=
+            MAP_FAILED) {
+            if ((size_t) (page - EC.map) < EC.map_lost) EC.map_lost = page - EC.map;
+            editor_wake();
+            return;
+        }
+    }
+    tcsetattr(EC.terminal_in, TCSAFLUSH, &EC.initial_state);
+    sigaction(signal, &(struct sigaction) {.sa_handler = SIG_DFL}, NULL);
+}
+
+// Sleeps until there is input or a wake-up, up to timeout milliseconds (-1 for no limit). Returns 1
+// when there is input to take.
+int input_wait(int timeout) {
+    if (input_pending()) return 1;
+
+    struct pollfd events[3] = {{EC.terminal_in, POLLIN, 0}, {EC.wake[0], POLLIN, 0},
+                               {EC.follow.inotify, POLLIN, 0}}; // Ignored while not following, as it's -1.
+    if (poll(events, 3, timeout) <= 0) return 0;
+    if (events[1].revents & POLLIN) {
+        char drain[64];
+        while (read(EC.wake[0], drain, sizeof(drain)) > 0);
+    }
+    return events[0].revents ? input_fill(0) : 0;
+}
+
+// Milliseconds until the status message should go away, or -1 when there is none on screen.
+int status_timeout() {
+    time_t left = EC.status_time + STATUS_SECONDS - time(NULL);
+    if (!EC.status[0] || left <= 0) return -1;
+    return left * 1000;
+}
+
+// Collects a bracketed paste into EC.paste a whole block of input at a time, up to the sequence that
+// closes it. Whatever came after it is left as input.
+void read_paste() {
+    struct paste *paste = &EC.paste;
+    struct input *input = &EC.input;
+    paste->size = 0;
+
+    while (input_fill(PASTE_WAIT)) { // Don't hang on a paste that never ends.
+        size_t size = input->size - input->next, seen = paste->size > 5 ? paste->size - 5 : 0;
+        if (paste->size + size > paste->capacity) {
+            paste->capacity = (paste->size + size) * 2;
+            paste->text = realloc(paste->text, paste->capacity);
+        }
+        memcpy(&paste->text[paste->size], &input->bytes[input->next], size);
+        paste->size += size;
+        input->next = input->size;
+
+        char *end = memmem(&paste->text[seen], paste->size - seen, "\x1b[201~", 6);
+        if (end) {
+            input->next -= paste->size - (end + 6 - paste->text);
+            paste->size = end - paste->text;
+            return;
+        }
+    }
+}
+
+// Waits for the next key without using any CPU in between. Resizes, rows being loaded and status
+// messages expiring end the wait early to have the screen redrawn.
+int read_key() {
+    int c, timeout = status_timeout();
+
+    pthread_mutex_unlock(&EC.lock); // Background work may touch the document while we wait.
+    int ready = input_wait(timeout);
+    pthread_mutex_lock(&EC.lock);
+    map_check(); // Before anything reads the rows of a file that may have shrunk meanwhile.
+    // The wake-up pipe was drained even if a key came along, and the frame drawn after it covers both.
+    EC.redraw_pending = 0;
+    if (EC.resized) {
+        EC.resized = 0;
+        if (window_size(&EC.rows, &EC.cols) == -1) editor_exit("window_size");
+        EC.rows -= 2;
+    }
+    if (!ready) {
+        if (EC.follow.inotify != -1) follow_update();
+        return REDRAW_KEY;
+    }
+    c = (unsigned char) EC.input.bytes[EC.input.next++];
+
+    // Process arrow key sequence to determine cursor direction.
+    if (c == '\x1b') {
+        int seq[2], number = 0;
+        if ((seq[0] = input_byte()) == -1) return '\x1b';
+        if ((seq[1] = input_byte()) == -1) return '\x1b';
+        if (seq[0] == '[') {
+            if (seq[1] >= '0' && seq[1] <= '9') {
+                for (; seq[1] >= '0' && seq[1] <= '9'; seq[1] = input_byte())
+                    if (number < 10000) number = number * 10 + seq[1] - '0';
+                if (seq[1] == '~') {
+                    switch (number) {
+                        case 1:
+                            return HOME_KEY;
+                        case 3:
+                            return DEL_KEY;
+                        case 4:
+                            return END_KEY;
+                        case 5:
+                            return PAGE_UP;
+                        case 6:
+                            return PAGE_DOWN;
+                        case 7:
+                            return HOME_KEY;
+                        case 8:
+                            return END_KEY;
+                        case 200:
+                            read_paste();
+                            return PASTE_KEY;
+                    }
+                }
+            } else {
+                switch (seq[1]) {
+                    case 'A':
+                        return UP;
+                    case 'B':
+                        return DOWN;
+                    case 'C':
+                        return RIGHT;
+                    case 'D':
+                        return LEFT;
+                    case 'H':
+                        return HOME_KEY;
+                    case 'F':
+                        return END_KEY;
+                }
+            }
+        } else if (seq[0] == 'O') {
+            switch (seq[1]) {
+                case 'H':
+                    return HOME_KEY;
+                case 'F':
+                    return END_KEY;
+            }
+        }
+
+        return '\x1b';
+    } else {
+        return c;
+    }
+}
+
+int cursor_position(int *rows, int *cols) {
+    char buf[32];
+    unsigned int i = 0;
+    if (write(EC.terminal_out, "\x1b[6n", 4) != 4) return -1;
+    struct pollfd terminal = {EC.terminal_in, POLLIN, 0};
+    while (i < sizeof(buf) - 1) {
+        if (poll(&terminal, 1, 1000) != 1 || read(EC.terminal_in, &buf[i], 1) != 1) break;
+        if (buf[i] == 'R') break;
+        i++;
+    }
+
+    buf[i] = '\0';
+    if (buf[0] != '\x1b' || buf[1] != '[') return -1;
+    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) return -1;
+
+    return 0;
+}
+
+int window_size(int *rows, int *cols) {
+    struct winsize ws;
+    if (ioctl(EC.terminal_out, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+        return cursor_position(rows, cols);
+    } else {
+        *cols = ws.ws_col;
+        *rows = ws.ws_row;
+        return 0;
+    }
+}
+
+void editor_init() {
+    EC.cursor_x = 0;
+    EC.cursor_y = 0;
+    EC.row_offset = 0;
+    EC.col_offset = 0;
+    EC.document_rows = 0;
+    EC.row = NULL;
+    EC.file_name = NULL;
+    EC.map = NULL;
+    EC.map_size = 0;
+    EC.map_fd = -1;
+    EC.map_lost = SIZE_MAX;
+    EC.page_size = sysconf(_SC_PAGESIZE);
+    EC.status[0] = '\0';
+    EC.status_time = 0;
+    EC.mode = READ_MODE;
+    memset(&EC.screen, 0, sizeof(EC.screen));
+    EC.frame = (struct buffer) BUFFER_INIT;
+    EC.follow.inotify = EC.follow.fd = -1;
+    syntax_select(NULL);
+    pthread_mutex_init(&EC.lock, NULL);
+    pthread_cond_init(&EC.loaded, NULL);
+    pthread_mutex_lock(&EC.lock);
+
+    if (window_size(&EC.rows, &EC.cols) == -1) editor_exit("window_size");
+    EC.rows -= 2; // Leave space for status bar and status messages.
+
+    if (pipe(EC.wake) == -1) editor_exit("pipe");
+    for (int i = 0; i < 2; ++i) {
+        fcntl(EC.wake[i], F_SETFL, O_NONBLOCK);
+        fcntl(EC.wake[i], F_SETFD, FD_CLOEXEC);
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_resize;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGWINCH, &action, NULL) == -1) editor_exit("sigaction");
+    action.sa_handler = NULL;
+    action.sa_sigaction = handle_fault;
+    action.sa_flags = SA_SIGINFO;
+    if (sigaction(SIGBUS, &action, NULL) == -1) editor_exit("sigaction");
+}
+
+/*** Syntax highlighting functions ***/
+const char *c_extensions[] = {".c", ".h", ".cc", ".cpp", ".cxx", ".hpp", ".hh", NULL};
+const char *c_keywords[] = {
+        "if", "else", "for", "while", "do", "switch", "case", "default", "break", "continue", "return", "goto",
+        "sizeof", "typedef", "struct", "union", "enum", "static", "const", "extern", "volatile", "inline",
+        "register", "restrict", "class", "public", "private", "protected", "namespace", "template", "typename",
+        "new", "delete", "this", "true", "false", "NULL", "nullptr", "using", "virtual", "override", "try",
+        "catch", "throw", "operator", "#include", "#define", "#if", "#ifdef", "#ifndef", "#else", "#elif",
+        "#endif", "#undef", "#pragma", NULL
+};
+const char *c_types[] = {
+        "int", "char", "short", "long", "float", "double", "void", "unsigned", "signed", "bool", "auto",
+        "size_t", "ssize_t", "int8_t", "int16_t", "int32_t", "int64_t", "uint8_t", "uint16_t", "uint32_t",
+        "uint64_t", "uintptr_t", "off_t", NULL
+};
+const char *python_extensions[] = {".py", NULL};
+const char *python_keywords[] = {
+        "and", "as", "assert", "async", "await", "break", "class", "continue", "def", "del", "elif", "else",
+        "except", "finally", "for", "from", "global", "if", "import", "in", "is", "lambda", "nonlocal", "not",
+        "or", "pass", "raise", "return", "try", "while", "with", "yield", "None", "True", "False", "self", NULL
+};
+const char *python_types[] = {"int", "float", "str", "bytes", "list", "dict", "set", "tuple", "bool", "object", NULL};
+const char *js_extensions[] = {".js", ".mjs", ".jsx", ".ts", ".tsx", NULL};
+const char *js_keywords[] = {
+        "if", "else", "for", "while", "do", "switch", "case", "default", "break", "continue", "return", "function",
+        "var", "let", "const", "new", "delete", "typeof", "instanceof", "in", "of", "this", "class", "extends",
+        "super", "import", "export", "from", "async", "await", "yield", "try", "catch", "finally", "throw",
+        "true", "false", "null", "undefined", "interface", "type", "enum", NULL
+};
+const char *js_types[] = {"number", "string", "boolean", "any", "void", "never", "unknown", "object", NULL};
+const char *go_extensions[] = {".go", NULL};
+const char *go_keywords[] = {
+        "break", "case", "chan", "const", "continue", "default", "defer", "else", "fallthrough", "for", "func",
+        "go", "goto", "if", "import", "interface", "map", "package", "range", "return", "select", "struct",
+        "switch", "type", "var", "true", "false", "nil", NULL
+};
+const char *go_types[] = {
+        "int", "int8", "int16", "int32", "int64", "uint", "uint8", "uint16", "uint32", "uint64", "uintptr",
+        "float32", "float64", "string", "bool", "byte", "rune", "error", NULL
+};
+const char *rust_extensions[] = {".rs", NULL};
+const char *rust_keywords[] = {
+        "as", "break", "const", "continue", "crate", "else", "enum", "extern", "false", "fn", "for", "if", "impl",
+        "in", "let", "loop", "match", "mod", "move", "mut", "pub", "ref", "return", "self", "Self", "static",
+        "struct", "super", "trait", "true", "type", "unsafe", "use", "where", "while", "async", "await", "dyn",
+        NULL
+};
+const char *rust_types[] = {
+        "i8", "i16", "i32", "i64", "i128", "isize", "u8", "u16", "u32", "u64", "u128", "usize", "f32", "f64",
+        "bool", "char", "str", "String", "Vec", "Option", "Result", "Box", NULL
+};
+const char *shell_extensions[] = {".sh", ".bash", NULL};
+const char *shell_keywords[] = {
+        "if", "then", "else", "elif", "fi", "case", "esac", "for", "while", "until", "do", "done", "in",
+        "function", "return", "local", "export", "readonly", NULL
+};
+const char *shell_types[] = {NULL};
+
+const struct syntax_rules syntaxes[] = {
+        {c_extensions, c_keywords, c_types, "//", "/*", "*/", "\"'"},
+        {python_extensions, python_keywords, python_types, "#", NULL, NULL, "\"'"},
+        {js_extensions, js_keywords, js_types, "//", "/*", "*/", "\"'`"},
+        {go_extensions, go_keywords, go_types, "//", "/*", "*/", "\"'`"},
+        {rust_extensions, rust_keywords, rust_types, "//", "/*", "*/", "\""},
+        {shell_extensions, shell_keywords, shell_types, "#", NULL, NULL, "\"'"}
+};
+
+unsigned int syntax_hash(const char *word, int size) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < size; ++i)
+        hash = (hash ^ (unsigned char) word[i]) * 16777619u;
+    return hash % KEYWORD_SLOTS;
+}
+
+int syntax_word_char(int c) {
+    return isalnum(c) || c == '_' || c == '#';
+}
+
+// State the lexer goes to on byte c from outside of any token.
+unsigned char syntax_start(const struct syntax_rules *rules, int c) {
+    if (!rules) return isdigit(c) ? LEX_NUMBER : LEX_NORMAL;
+
+    const char *quote = c ? strchr(rules->quotes, c) : NULL;
+    if (rules->line_comment && c == rules->line_comment[0])
+        return rules->line_comment[1] ? LEX_COMMENT_START : LEX_LINE_COMMENT;
+    if (rules->block_start && c == rules->block_start[0]) return LEX_COMMENT_START;
+    if (quote) return LEX_STRING + 3 * (quote - rules->quotes);
+    if (isdigit(c)) return LEX_NUMBER;
+    if (syntax_word_char(c)) return LEX_WORD;
+    return LEX_NORMAL;
+}
+
+void syntax_compile(struct syntax *syntax, const struct syntax_rules *rules) {
+    memset(syntax, 0, sizeof(struct syntax));
+    syntax->rules = rules;
+    for (int c = 0; c < 256; ++c) {
+        unsigned char start = syntax_start(rules, c);
+        for (int state = 0; state < LEX_STATES; ++state)
+            syntax->next[state][c] = start;
+        if (!rules) continue;
+
+        syntax->next[LEX_WORD][c] = syntax_word_char(c) ? LEX_WORD : start;
+        syntax->next[LEX_NUMBER][c] = isalnum(c) || c == '.' ? LEX_NUMBER : start;
+        if (rules->line_comment && rules->line_comment[1] == c)
+            syntax->next[LEX_COMMENT_START][c] = LEX_LINE_COMMENT_OPEN;
+        syntax->next[LEX_LINE_COMMENT_OPEN][c] = syntax->next[LEX_LINE_COMMENT][c] = LEX_LINE_COMMENT;
+        if (rules->block_start) {
+            unsigned char block = c == rules->block_end[0] ? LEX_BLOCK_COMMENT_END : LEX_BLOCK_COMMENT;
+            if (rules->block_start[1] == c) syntax->next[LEX_COMMENT_START][c] = LEX_BLOCK_COMMENT_OPEN;
+            syntax->next[LEX_BLOCK_COMMENT_OPEN][c] = syntax->next[LEX_BLOCK_COMMENT][c] = block;
+            syntax->next[LEX_BLOCK_COMMENT_END][c] = c == rules->block_end[1] ? LEX_BLOCK_COMMENT_CLOSE : block;
+        }
+        for (int quote = 0; rules->quotes[quote]; ++quote) {
+            int string = LEX_STRING + 3 * quote;
+            syntax->next[string][c] = c == '\\' ? string + 1 : c == rules->quotes[quote] ? string + 2 : string;
+            syntax->next[string + 1][c] = string;
+        }
+    }
+
+    syntax->highlight[LEX_NUMBER] = HL_NUMBER;
+    for (int state = LEX_LINE_COMMENT_OPEN; state <= LEX_BLOCK_COMMENT_CLOSE; ++state)
+        syntax->highlight[state] = HL_COMMENT;
+    for (int state = LEX_STRING; state < LEX_STATES; ++state)
+        syntax->highlight[state] = HL_STRING;
+    syntax->back[LEX_LINE_COMMENT_OPEN] = syntax->back[LEX_BLOCK_COMMENT_OPEN] = 1;
+    for (int state = LEX_BLOCK_COMMENT_OPEN; state <= LEX_BLOCK_COMMENT_END; ++state)
+        syntax->line_end[state] = LEX_BLOCK_COMMENT;
+    syntax->multiline = rules && rules->block_start;
+
+    for (int kind = 0; rules && kind < 2; ++kind) {
+        const char **words = kind ? rules->types : rules->keywords;
+        for (; *words; ++words) {
+            unsigned int slot = syntax_hash(*words, strlen(*words));
+            while (syntax->words[slot]) slot = (slot + 1) % KEYWORD_SLOTS;
+            syntax->words[slot] = *words;
+            syntax->word_highlight[slot] = kind ? HL_TYPE : HL_KEYWORD;
+        }
+    }
+}
+
+// Colors a word if it's a keyword or a type.
+void syntax_word(struct syntax *syntax, const char *word, int size, unsigned char *highlight) {
+    for (unsigned int slot = syntax_hash(word, size); syntax->words[slot]; slot = (slot + 1) % KEYWORD_SLOTS) {
+        if (strncmp(syntax->words[slot], word, size) == 0 && syntax->words[slot][size] == '\0') {
+            memset(highlight, syntax->word_highlight[slot], size);
+            return;
+        }
+    }
+}
+
+// Runs the lexer over some bytes, returning the state it ends in.
+unsigned char syntax_scan(struct syntax *syntax, unsigned char state, const char *p, size_t size) {
+    for (const char *end = p + size; p < end; ++p)
+        state = syntax->next[state][(unsigned char) *p];
+    return state;
+}
+
+// Same as syntax_scan, coloring the bytes on the way.
+unsigned char syntax_highlight(struct syntax *syntax, unsigned char state, const char *p, int size,
+                               unsigned char *highlight) {
+    int word = -1; // Where the current word started, unless it did so before p.
+    for (int i = 0; i < size; ++i) {
+        unsigned char next = syntax->next[state][(unsigned char) p[i]];
+        if (next == LEX_WORD && state != LEX_WORD) word = i;
+        else if (state == LEX_WORD && next != LEX_WORD && word >= 0)
+            syntax_word(syntax, &p[word], i - word, &highlight[word]);
+        highlight[i] = syntax->highlight[next];
+        if (syntax->back[next] && i > 0) highlight[i - 1] = highlight[i];
+        state = next;
+    }
+    if (state == LEX_WORD && word >= 0) syntax_word(syntax, &p[word], size - word, &highlight[word]);
+    return state;
+}
+
+void row_set_syntax(document_row *row, unsigned char state) {
+    if (row->cache) row->cache->size = -1;
+    syntax_highlight(&EC.syntax, state, row->render_content, row->render_size, row->highlight);
+}
+
+// Index of the first queued row at or after i.
+int syntax_find(int i) {
+    int low = 0, high = EC.syntax_dirty_count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (EC.syntax_dirty[middle] < i) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+// Queues row i to have its end state worked out again.
+void syntax_invalidate(int i) {
+    if (!EC.syntax.multiline || i >= EC.document_rows) return;
+
+    int low = syntax_find(i);
+    if (low < EC.syntax_dirty_count && EC.syntax_dirty[low] == i) return;
+
+    if (EC.syntax_dirty_count == EC.syntax_dirty_capacity) {
+        EC.syntax_dirty_capacity = EC.syntax_dirty_capacity ? EC.syntax_dirty_capacity * 2 : 16;
+        EC.syntax_dirty = realloc(EC.syntax_dirty, sizeof(int) * EC.syntax_dirty_capacity);
+    }
+    memmove(&EC.syntax_dirty[low + 1], &EC.syntax_dirty[low], sizeof(int) * (EC.syntax_dirty_count - low));
+    EC.syntax_dirty[low] = i;
+    ++EC.syntax_dirty_count;
+}
+
+// Keeps the queued rows in place when a row is inserted at i (delta 1) or removed from there (delta -1).
+void syntax_rows_moved(int i, int delta) {
+    int first = EC.syntax_dirty_count;
+    while (first > 0 && EC.syntax_dirty[first - 1] >= i) --first;
+    if (delta < 0 && first < EC.syntax_dirty_count && EC.syntax_dirty[first] == i) {
+        --EC.syntax_dirty_count;
+        memmove(&EC.syntax_dirty[first], &EC.syntax_dirty[first + 1], sizeof(int) * (EC.syntax_dirty_count - first));
+    }
+    for (int k = first; k < EC.syntax_dirty_count; ++k)
+        EC.syntax_dirty[k] += delta;
+    if (delta < 0) syntax_invalidate(i); // The row that took its place comes after a different one now.
+}
+
+// State a row ends in. One that was never worked out, which only a missed syntax_invalidate leaves
+// behind, is taken to end outside of anything rather than index the lexer table with LEX_UNKNOWN.
+unsigned char syntax_exit(document_row *row) {
+    return EC.syntax.multiline && row->state_out != LEX_UNKNOWN ? row->state_out : LEX_NORMAL;
+}
+
+// Works out the state each row before the given one ends in. Starting at every queued row, rows are
+// gone through until one ends in the same state as before and the next isn't queued itself, as the
+// ones after it are still right then.
+void syntax_update(int rows) {
+    int done = 0, carry = 0; // Queued rows gone through, taken off the queue at once however many.
+    while (!carry && done < EC.syntax_dirty_count && EC.syntax_dirty[done] < rows) {
+        int i = EC.syntax_dirty[done], count = 0;
+        unsigned char state = i ? syntax_exit(row_at(i - 1)) : LEX_NORMAL;
+        document_row *row = NULL;
+
+        for (; i < EC.document_rows; ++i, ++row, --count) {
+            if (count == 0) row = row_span(i, &count);
+            while (done < EC.syntax_dirty_count && EC.syntax_dirty[done] <= i) ++done;
+
+            state = EC.syntax.line_end[row_state_at(row, state, row->size)];
+            if (state == row->state_out && (done == EC.syntax_dirty_count || EC.syntax_dirty[done] != i + 1)) break;
+            row->state_out = state;
+            if (i + 1 == rows) { // Not needed yet, so carry on from here next time.
+                carry = 1;
+                break;
+            }
+        }
+        if (i >= EC.document_rows) done = EC.syntax_dirty_count;
+    }
+    EC.syntax_dirty_count -= done;
+    if (done) memmove(EC.syntax_dirty, &EC.syntax_dirty[done], sizeof(int) * EC.syntax_dirty_count);
+    if (carry) syntax_invalidate(rows);
+}
+
+// State row i starts in.
+unsigned char syntax_entry(int i) {
+    return i > 0 && i <= EC.document_rows ? syntax_exit(row_at(i - 1)) : LEX_NORMAL;
+}
+
+// Picks the rules to highlight with from the extension of the file name.
+void syntax_select(char *file_name) {
+    const struct syntax_rules *rules = NULL;
+    char *extension = file_name ? strrchr(file_name, '.') : NULL;
+    for (size_t k = 0; extension && !rules && k < sizeof(syntaxes) / sizeof(syntaxes[0]); ++k)
+        for (const char **match = syntaxes[k].extensions; *match && !rules; ++match)
+            if (strcmp(extension, *match) == 0) rules = &syntaxes[k];
+    if (rules == EC.syntax.rules && EC.syntax.highlight[LEX_NUMBER]) return; // Already compiled.
+
+    // Anything highlighted so far followed other rules.
+    syntax_compile(&EC.syntax, rules);
+    EC.syntax_dirty_count = 0;
+    for (int i = 0, count = 0; i < EC.document_rows; i += count) {
+        document_row *row = row_span(i, &count);
+        for (int k = 0; k < count; ++k) {
+            row[k].flags |= ROW_STALE;
+            row[k].state_in = row[k].state_out = row[k].states_from = LEX_UNKNOWN;
+            row[k].state_count = 0;
+        }
+    }
+    syntax_invalidate(0);
+}
+
+int syntax_to_color_code(int highlight) {
+    switch (highlight) {
+        case HL_NUMBER:
+            return 31;
+        case HL_STRING:
+            return 35;
+        case HL_COMMENT:
+            return 36;
+        case HL_KEYWORD:
+            return 33;
+        case HL_TYPE:
+            return 32;
+        default:
+            return 39;
+    }
+}
+
+/*** Output functions ***/
+void scroll_window() {
+    if (EC.cursor_y < EC.row_offset) // Check if cursor above visible window and scroll up
+        EC.row_offset = EC.cursor_y;
+    if (EC.cursor_y >= EC.row_offset + EC.rows) // Check if cursor below visible window and scroll down
+        EC.row_offset = EC.cursor_y - EC.rows + 1;
+    EC.render_x = EC.cursor_y < EC.document_rows ? row_render_x(row_at(EC.cursor_y), EC.cursor_x) : 0;
+    if (EC.render_x < EC.col_offset)
+        EC.col_offset = EC.render_x;
+    if (EC.render_x >= EC.col_offset + EC.cols)
+        EC.col_offset = EC.render_x - EC.cols + 1;
+}
+
+void set_status(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(EC.status, sizeof(EC.status), fmt, ap);
+    va_end(ap);
+    EC.status_time = time(NULL);
+}
+
+// Forgets what the terminal shows so the next refresh repaints everything.
+void screen_invalidate() {
+    struct screen *screen = &EC.screen;
+    int cells = EC.rows * EC.cols;
+
+    if (screen->rows != EC.rows || screen->cols != EC.cols) {
+        screen->rows = EC.rows;
+        screen->cols = EC.cols;
+        screen->chars = realloc(screen->chars, cells);
+        screen->highlight = realloc(screen->highlight, cells);
+        screen->line_chars = realloc(screen->line_chars, EC.cols);
+        screen->line_highlight = realloc(screen->line_highlight, EC.cols);
+        screen->status_bar = realloc(screen->status_bar, EC.cols + 1);
+        screen->message_bar = realloc(screen->message_bar, EC.cols + 1);
+    }
+
+    memset(screen->chars, 0, cells);
+    memset(screen->highlight, 0xff, cells); // Never a real highlight, so every cell differs.
+    screen->status_bar_size = screen->message_bar_size = -1;
+    screen->cursor_x = screen->cursor_y = -1;
+    screen->row_offset = -1;
+}
+
+// Moves the rows already on the terminal with a scroll region when the window scrolled by less than a
+// screen, so only the newly exposed lines are left to draw.
+void scroll_screen(struct buffer *buff) {
+    struct screen *screen = &EC.screen;
+    int delta = EC.row_offset - screen->row_offset, lines = abs(delta);
+    if (screen->row_offset < 0 || delta == 0 || lines >= EC.rows) return;
+
+    char sequence[48];
+    int size = snprintf(sequence, sizeof(sequence), "\x1b[1;%dr\x1b[%d%c\x1b[r", EC.rows, lines, delta > 0 ? 'S' : 'T');
+    buffer_append(buff, sequence, size);
+
+    int kept = (EC.rows - lines) * EC.cols, exposed = lines * EC.cols;
+    int from = delta > 0 ? exposed : 0, to = delta > 0 ? 0 : exposed, blank = delta > 0 ? kept : 0;
+    memmove(&screen->chars[to], &screen->chars[from], kept);
+    memmove(&screen->highlight[to], &screen->highlight[from], kept);
+    memset(&screen->chars[blank], ' ', exposed);
+    memset(&screen->highlight[blank], HL_DEFAULT, exposed);
+    screen->row_offset = EC.row_offset;
+}
+
+void append_color(struct buffer *buff, int highlight) {
+    char sgr[16];
+    buffer_append(buff, sgr, snprintf(sgr, sizeof(sgr), "\x1b[%dm", syntax_to_color_code(highlight)));
+}
+
+// Appends cells, only switching colors where the highlight changes.
+void draw_cells(struct buffer *buff, char *chars, unsigned char *highlight, int size) {
+    int current_color = HL_DEFAULT, start = 0;
+
+    for (int j = 0; j <= size; ++j) {
+        if (j < size && highlight[j] == current_color) continue;
+        buffer_append(buff, &chars[start], j - start);
+        if (j == size) break;
+
+        current_color = highlight[j];
+        append_color(buff, current_color);
+        start = j;
+    }
+    if (current_color != HL_DEFAULT) buffer_append(buff, "\x1b[39m", 5);
+}
+
+// Whether a row has no colors at all, given how many runs of one highlight it has.
+int row_plain(int render_size, int runs, unsigned char *highlight) {
+    return render_size == 0 || (runs == 1 && highlight[0] == HL_DEFAULT);
+}
+
+// Rebuilds the encoded bytes of a row if its render or highlight changed since they were last built.
+void row_encode(document_row *row) {
+    if (!row->cache) {
+        row->cache = calloc(1, sizeof(row_cache));
+        STAT_HELD(cache_bytes, row->cache);
+        row->cache->size = -1;
+    }
+
+    row_cache *cache = row->cache;
+    if (cache->size >= 0) return;
+
+    int runs = 1, j;
+    for (j = 1; j < row->render_size; ++j)
+        runs += row->highlight[j] != row->highlight[j - 1];
+    if (runs > cache->run_capacity) {
+        cache->run_capacity = runs > cache->run_capacity * 2 ? runs : cache->run_capacity * 2;
+        STAT_RELEASED(cache_bytes, cache->runs);
+        free(cache->runs);
+        cache->runs = malloc(sizeof(struct row_run) * cache->run_capacity);
+        STAT_HELD(cache_bytes, cache->runs);
+    }
+
+    if (row_plain(row->render_size, runs, row->highlight)) {
+        cache->runs[0] = (struct row_run) {0, 0, HL_DEFAULT};
+        cache->run_count = 1;
+        cache->size = row->render_size;
+        return;
+    }
+
+    if (row->render_size + runs * 16 > cache->capacity) {
+        int capacity = row->render_size + runs * 16;
+        cache->capacity = capacity > cache->capacity * 2 ? capacity : cache->capacity * 2;
+        STAT_RELEASED(cache_bytes, cache->bytes);
+        free(cache->bytes);
+        cache->bytes = malloc(cache->capacity);
+        STAT_HELD(cache_bytes, cache->bytes);
+    }
+    cache->run_count = cache->size = 0;
+    for (j = 0; j < row->render_size;) {
+        unsigned char highlight = row->highlight[j];
+        int end = j;
+        while (end < row->render_size && row->highlight[end] == highlight) ++end;
+
+        if (j > 0 || highlight != HL_DEFAULT)
+            cache->size += sprintf(&cache->bytes[cache->size], "\x1b[%dm", syntax_to_color_code(highlight));
+        cache->runs[cache->run_count++] = (struct row_run) {j, cache->size, highlight};
+        memcpy(&cache->bytes[cache->size], &row->render_content[j], end - j);
+        cache->size += end - j;
+        j = end;
+    }
+}
+
+// Finds the run holding render column col.
+struct row_run *row_run_at(row_cache *cache, int col) {
+    int low = 0, high = cache->run_count - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (cache->runs[middle].col <= col) low = middle;
+        else high = middle - 1;
+    }
+    return &cache->runs[low];
+}
+
+// Appends render columns [from, to) of a row straight from its encoded bytes.
+void row_draw(struct buffer *buff, document_row *row, int from, int to) {
+    from -= row->render_start;
+    to -= row->render_start;
+    row_encode(row);
+    row_cache *cache = row->cache;
+    if (row_plain(row->render_size, cache->run_count, row->highlight)) {
+        buffer_reference(buff, &row->render_content[from], to - from);
+        return;
+    }
+
+    struct row_run *first = row_run_at(cache, from), *last = row_run_at(cache, to - 1);
+    int start = first->offset + from - first->col, end = last->offset + to - last->col;
+    if (first->highlight != HL_DEFAULT) append_color(buff, first->highlight);
+    buffer_reference(buff, &cache->bytes[start], end - start);
+    if (last->highlight != HL_DEFAULT) buffer_append(buff, "\x1b[39m", 5);
+}
+
+// Sends the span of screen row y that differs from what the terminal shows. Cells past size are blank,
+// and the others come from row when there is one.
+void draw_line(struct buffer *buff, int y, int size, document_row *row) {
+    struct screen *screen = &EC.screen;
+    char *chars = screen->line_chars, *old_chars = &screen->chars[y * EC.cols];
+    unsigned char *highlight = screen->line_highlight, *old_highlight = &screen->highlight[y * EC.cols];
+
+    int first = 0, last = EC.cols - 1;
+    while (first < EC.cols && chars[first] == old_chars[first] && highlight[first] == old_highlight[first])
+        ++first;
+    if (first == EC.cols) return;
+    while (chars[last] == old_chars[last] && highlight[last] == old_highlight[last])
+        --last;
+
+    // Cells are bytes while the terminal shows a multibyte character in one column, so a span is only
+    // placed right where every byte before it is plain ASCII. Otherwise the line is sent from the start,
+    // and to its end if the width of what changed may have moved the rest of it.
+    int plain = 0;
+    while (plain <= last && !((chars[plain] | old_chars[plain]) & 0x80))
+        ++plain;
+    if (plain < first) first = 0;
+    if (plain <= last) last = EC.cols - 1;
+
+    char position[32];
+    buffer_append(buff, position, snprintf(position, sizeof(position), "\x1b[%d;%dH", y + 1, first + 1));
+    int end = last >= size ? size : last + 1; // A change reaching the blank tail is cheaper to erase.
+    if (end > first && row) row_draw(buff, row, EC.col_offset + first, EC.col_offset + end);
+    else if (end > first) draw_cells(buff, &chars[first], &highlight[first], end - first);
+    if (last >= size) buffer_append(buff, "\x1b[K", 3);
+
+    memcpy(old_chars, chars, EC.cols);
+    memcpy(old_highlight, highlight, EC.cols);
+}
+
+// Index of the first rendered row at or after i.
+int rendered_find(int i) {
+    int low = 0, high = EC.rendered_count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (EC.rendered[middle] < i) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+void rendered_add(int i) {
+    int k = rendered_find(i);
+    if (k < EC.rendered_count && EC.rendered[k] == i) return;
+    if (EC.rendered_count == EC.rendered_capacity) {
+        EC.rendered_capacity = EC.rendered_capacity ? EC.rendered_capacity * 2 : 64;
+        EC.rendered = realloc(EC.rendered, sizeof(int) * EC.rendered_capacity);
+    }
+    memmove(&EC.rendered[k + 1], &EC.rendered[k], sizeof(int) * (EC.rendered_count - k));
+    EC.rendered[k] = i;
+    ++EC.rendered_count;
+}
+
+// Keeps the rendered rows in place when a row is inserted at i (delta 1) or removed from there (delta -1).
+void rendered_rows_moved(int i, int delta) {
+    int k = rendered_find(i);
+    if (delta < 0 && k < EC.rendered_count && EC.rendered[k] == i) { // Freed along with the row.
+        --EC.rendered_count;
+        memmove(&EC.rendered[k], &EC.rendered[k + 1], sizeof(int) * (EC.rendered_count - k));
+    }
+    for (; k < EC.rendered_count; ++k)
+        EC.rendered[k] += delta;
+}
+
+// Lets go of the render of every row outside [from, to). They're cheap to work out again if they come
+// back into view, while keeping them would have memory grow with every row ever shown.
+void rendered_trim(int from, int to) {
+    int first = rendered_find(from), last = rendered_find(to > from ? to : from);
+    for (int k = 0; k < first; ++k)
+        row_release(row_at(EC.rendered[k]));
+    for (int k = last; k < EC.rendered_count; ++k)
+        row_release(row_at(EC.rendered[k]));
+    EC.rendered_count = last - first;
+    if (first) memmove(EC.rendered, &EC.rendered[first], sizeof(int) * EC.rendered_count);
+}
+
+void draw_rows(struct buffer *buff) {
+    char *chars = EC.screen.line_chars;
+    unsigned char *highlight = EC.screen.line_highlight;
+
+    // Rows off screen aren't referenced by this frame, whatever the last one sent is out already.
+    rendered_trim(EC.row_offset - RENDER_SCREENS * EC.rows, EC.row_offset + (RENDER_SCREENS + 1) * EC.rows);
+    syntax_update(EC.row_offset + EC.rows - 1);
+    unsigned char state = syntax_entry(EC.row_offset);
+    for (int r = 0; r < EC.rows; ++r) {
+        int i = r + EC.row_offset, size = 0;
+        document_row *row = NULL;
+        if (i >= EC.document_rows) {
+            chars[0] = '~';
+            highlight[0] = HL_DEFAULT;
+            size = 1;
+        } else {
+            row = row_at(i);
+            row_prepare(row, state);
+            rendered_add(i);
+            state = syntax_exit(row);
+            int start = EC.col_offset - row->render_start;
+            size = row->render_size - start;
+            if (size < 0) size = 0;
+            if (size > EC.cols) size = EC.cols;
+            if (size) {
+                memcpy(chars, &row->render_content[start], size);
+                memcpy(highlight, &row->highlight[start], size);
+            }
+        }
+
+        memset(&chars[size], ' ', EC.cols - size);
+        memset(&highlight[size], HL_DEFAULT, EC.cols - size);
+        draw_line(buff, r, size, row);
+    }
+}
+
+void draw_message_bar(struct buffer *buff) {
+    struct screen *screen = &EC.screen;
+    char *message = EC.status;
+    int size = strlen(EC.status);
+    if (time(NULL) - EC.status_time >= STATUS_SECONDS) size = 0;
+#ifndef RED_NO_STATS
+    char stats[sizeof(EC.status)];
+    if (EC.stats.overlay) {
+        stats_describe(stats, sizeof(stats));
+        message = stats;
+        size = strlen(stats);
+    }
+#endif
+    if (size > EC.cols) size = EC.cols;
+    if (size == screen->message_bar_size && memcmp(message, screen->message_bar, size) == 0) return;
+
+    char position[32];
+    buffer_append(buff, position, snprintf(position, sizeof(position), "\x1b[%d;1H", EC.rows + 2));
+    buffer_append(buff, message, size);
+    buffer_append(buff, "\x1b[K", 3);
+    memcpy(screen->message_bar, message, size);
+    screen->message_bar_size = size;
+}
+
+void draw_status_bar(struct buffer *buff) {
+    struct screen *screen = &EC.screen;
+    char status[80], *mode;
+    switch (EC.mode) {
+        default:
+        case READ_MODE:
+            mode = stringify(READ_MODE);
+            break;
+        case EDIT_MODE:
+            mode = stringify(EDIT_MODE);
+            break;
+    }
+    char progress[16] = "";
+    if (EC.loading && EC.map_size)
+        snprintf(progress, sizeof(progress), ", %d%%", (int) (EC.load_progress * 100 / EC.map_size));
+    else if (EC.streaming) snprintf(progress, sizeof(progress), ", reading");
+    else if (EC.finding.running && EC.document_rows)
+        snprintf(progress, sizeof(progress), ", finding %d%%", (int) (EC.finding.next * 100LL / EC.document_rows));
+    else if (EC.follow.inotify != -1) snprintf(progress, sizeof(progress), ", following");
+    int cols = snprintf(
+            status,
+            sizeof(status),
+            " %.20s - %d lines%s [%s]",
+            EC.file_name ? EC.file_name : "[New document]",
+            EC.document_rows,
+            progress,
+            mode
+    );
+
+    if (cols > EC.cols) cols = EC.cols;
+    if (cols == screen->status_bar_size && memcmp(status, screen->status_bar, cols) == 0) return;
+    memcpy(screen->status_bar, status, cols);
+    screen->status_bar_size = cols;
+
+    char position[32];
+    buffer_append(buff, position, snprintf(position, sizeof(position), "\x1b[%d;1H", EC.rows + 1));
+    buffer_append(buff, "\x1b[7m", 4); // Invert colors
+    buffer_append(buff, status, cols);
+    while (++cols < EC.cols)
+        buffer_append(buff, " ", 1);
+    buffer_append(buff, "\x1b[m", 3);
+}
+
+void refresh_screen() {
+    STAT_START(frame_time);
+    scroll_window();
+    if (EC.screen.rows != EC.rows || EC.screen.cols != EC.cols) screen_invalidate();
+
+    struct buffer *buff = &EC.frame;
+    buffer_append(buff, "\x1b[?25l", 6);
+
+    scroll_screen(buff);
+    draw_rows(buff);
+    EC.screen.row_offset = EC.row_offset;
+    draw_status_bar(buff);
+    draw_message_bar(buff);
+
+    // Skip the write entirely when neither the cells nor the cursor changed.
+    int cursor_y = EC.cursor_y - EC.row_offset, cursor_x = EC.render_x - EC.col_offset;
+    if (buffer_length(buff) > 6 || cursor_y != EC.screen.cursor_y || cursor_x != EC.screen.cursor_x) {
+        char cursor_buff[32];
+        snprintf(cursor_buff, sizeof(cursor_buff), "\x1b[%d;%dH", cursor_y + 1, cursor_x + 1);
+        buffer_append(buff, cursor_buff, strlen(cursor_buff));
+        buffer_append(buff, "\x1b[?25h", 6);
+#ifndef RED_NO_STATS
+        stats_frame(buffer_length(buff));
+#endif
+        buffer_flush(buff, EC.terminal_out);
+        EC.screen.cursor_y = cursor_y;
+        EC.screen.cursor_x = cursor_x;
+    } else {
+        buffer_reset(buff);
+#ifndef RED_NO_STATS
+        stats_frame(0);
+#endif
+    }
+}
+
+/*** Search ***/
+void match_push(struct matches *matches, int row, int col) {
+    if (matches->count == matches->capacity) {
+        matches->capacity = matches->capacity ? matches->capacity * 2 : 16;
+        matches->match = realloc(matches->match, sizeof(struct match) * matches->capacity);
+    }
+    matches->match[matches->count].row = row;
+    matches->match[matches->count++].col = col;
+}
+
+// Finds the first occurrence of a needle. Candidates are filtered a block at a time by comparing both
+// the first and the last byte of the needle, and only those passing both are compared in full.
+char *literal_find(char *haystack, size_t size, char *needle, size_t needle_size) {
+    if (needle_size == 0 || needle_size > size) return NULL;
+
+    size_t i = 0, last = size - needle_size; // Last position a match can start at.
+#if defined(__AVX2__)
+    __m256i first = _mm256_set1_epi8(needle[0]), final = _mm256_set1_epi8(needle[needle_size - 1]);
+    for (; i + 32 <= last + 1; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((__m256i *) &haystack[i]);
+        __m256i block_last = _mm256_loadu_si256((__m256i *) &haystack[i + needle_size - 1]);
+        unsigned int mask = _mm256_movemask_epi8(
+                _mm256_and_si256(_mm256_cmpeq_epi8(first, block_first), _mm256_cmpeq_epi8(final, block_last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(&haystack[i + bit], needle, needle_size) == 0) return &haystack[i + bit];
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__SSE2__)
+    __m128i first = _mm_set1_epi8(needle[0]), final = _mm_set1_epi8(needle[needle_size - 1]);
+    for (; i + 16 <= last + 1; i += 16) {
+        __m128i block_first = _mm_loadu_si128((__m128i *) &haystack[i]);
+        __m128i block_last = _mm_loadu_si128((__m128i *) &haystack[i + needle_size - 1]);
+        unsigned int mask = _mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(final, block_last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(&haystack[i + bit], needle, needle_size) == 0) return &haystack[i + bit];
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    while (i <= last) { // Whatever is left, or everything without SIMD.
+        char *candidate = memchr(&haystack[i], needle[0], last - i + 1);
+        if (!candidate) return NULL;
+        if (memcmp(candidate, needle, needle_size) == 0) return candidate;
+        i = candidate - haystack + 1;
+    }
+    return NULL;
+}
+
+// Tells whether a pattern matches only itself, i.e. has no basic regular expression metacharacter.
+int pattern_is_literal(char *pattern) {
+    return strpbrk(pattern, ".[]*^$\\") == NULL;
+}
+
+// Rows that sit back to back in the file mapping, separated by nothing but a line break.
+int rows_adjacent(document_row *a, document_row *b) {
+    if (!(a->flags & ROW_BORROWED) || !(b->flags & ROW_BORROWED)) return 0;
+
+    char *end = a->content + a->size;
+    if (b->content <= end || b->content - end > 16) return 0;
+    for (; end < b->content; ++end)
+        if (*end != '\n' && *end != '\r') return 0;
+    return 1;
+}
+
+// Searches a literal over runs of adjacent rows as single blocks of bytes. Needles can't hold line breaks,
+// so a hit always lands inside a row.
+void rows_find_literal(struct search *search, document_row *row, int count, int i, struct matches *matches) {
+    for (int j = 0, k; j < count; j = k) {
+        for (k = j + 1; k < count && rows_adjacent(&row[k - 1], &row[k]); ++k);
+
+        char *hit = row[j].content, *end = row[k - 1].content + row[k - 1].size;
+        int r = j;
+        while ((hit = literal_find(hit, end - hit, search->literal, search->literal_size))) {
+            while (hit >= row[r].content + row[r].size) ++r;
+            match_push(matches, i + r, hit - row[r].content);
+            hit += search->literal_size;
+        }
+    }
+}
+
+// Collects every match of a compiled pattern in a row. Rows aren't NUL terminated when borrowed, so the
+// range is given through REG_STARTEND.
+void row_find(regex_t *compiled, document_row *row, int i, struct matches *matches) {
+    regmatch_t match;
+    int offset = 0;
+
+    while (offset <= row->size) {
+        match.rm_so = offset;
+        match.rm_eo = row->size;
+        if (regexec(compiled, row->content, 1, &match, REG_STARTEND) != 0) break;
+
+        match_push(matches, i, match.rm_so);
+        offset = match.rm_eo > match.rm_so ? match.rm_eo : match.rm_so + 1;
+    }
+}
+
+void find_task(int task, int worker, void *context) {
+    struct search *search = context;
+    int from = task * search->rows_per_task, to = from + search->rows_per_task, count;
+    if (to > search->row_count) to = search->row_count;
+
+    for (int k = from; k < to; k += count) {
+        int i = search->rows ? search->rows[k] : search->first + k, start;
+        row_node *node = node_find(i, &start, 0);
+        document_row *row = &node->row[i - start];
+        count = node->size - (i - start);
+        if (count > to - k) count = to - k;
+        if (search->rows) count = 1;
+        if (node->trigrams && !trigrams_contain(node->trigrams, search->trigrams, search->trigram_count)) continue;
+        if (!search->compiled) {
+            rows_find_literal(search, row, count, i, &search->results[task]);
+            continue;
+        }
+        for (int j = 0; j < count; ++j)
+            row_find(&search->compiled[worker], &row[j], i + j, &search->results[task]);
+    }
+}
+
+// Prepares a search: plain strings are matched as they are, anything else is compiled once per worker.
+// Returns -1 if the pattern doesn't compile.
+int search_compile(struct search *search, char *pattern) {
+    int workers = workers_size(), size = strlen(pattern), required_size, i;
+    char required[size + 1];
+
+    memset(search, 0, sizeof(struct search));
+    if (pattern_is_literal(pattern)) {
+        strcpy(required, pattern);
+        required_size = size;
+    } else {
+        required_size = pattern_required_literal(pattern, required);
+        // glibc serializes regexec calls sharing a regex_t, so every worker gets its own compiled copy.
+        search->compiled = malloc(sizeof(regex_t) * workers);
+        for (i = 0; i < workers; ++i) {
+            if (regcomp(&search->compiled[i], pattern, 0) != 0) {
+                while (i--) regfree(&search->compiled[i]);
+                free(search->compiled);
+                return -1;
+            }
+        }
+    }
+
+    search->literal = strdup(pattern);
+    search->literal_size = size;
+    search->trigrams = malloc(sizeof(unsigned int) * (size + 1));
+    for (i = 0; i + 2 < required_size; ++i)
+        search->trigrams[search->trigram_count++] = trigram_hash(&required[i]);
+    return 0;
+}
+
+void search_free(struct search *search) {
+    for (int i = 0; search->compiled && i < workers_size(); ++i)
+        regfree(&search->compiled[i]);
+    free(search->compiled);
+    free(search->literal);
+    free(search->trigrams);
+    memset(search, 0, sizeof(struct search));
+}
+
+// Finds the matches of a prepared search in rows from to to, or in the listed rows from to to when there
+// is a list of them, spreading them over the worker pool. Matches are added to the end, sorted by position.
+void find(struct search *search, int *rows, int from, int to, struct matches *matches) {
+    int tasks = workers_size() * 4, last = rows ? EC.document_rows : to, i, start;
+
+    // Workers can't build chunks known only from a line index, so that happens here first.
+    for (i = rows ? 0 : from; EC.loading && i < last; i = start + node_find(i, &start, 0)->size);
+
+    search->rows = rows ? &rows[from] : NULL;
+    search->first = from;
+    search->row_count = to - from;
+    search->rows_per_task = (search->row_count + tasks - 1) / tasks;
+    if (search->rows_per_task < ROW_CHUNK) search->rows_per_task = ROW_CHUNK;
+    tasks = (search->row_count + search->rows_per_task - 1) / search->rows_per_task;
+    search->results = calloc(tasks ? tasks : 1, sizeof(struct matches));
+    workers_run(tasks, find_task, search);
+
+    for (i = 0; i < tasks; ++i) {
+        struct matches *result = &search->results[i];
+        if (matches->count + result->count > matches->capacity) {
+            matches->capacity = (matches->count + result->count) * 2;
+            matches->match = realloc(matches->match, sizeof(struct match) * matches->capacity);
+        }
+        memcpy(&matches->match[matches->count], result->match, sizeof(struct match) * result->count);
+        matches->count += result->count;
+        free(result->match);
+    }
+    free(search->results);
+    search->results = NULL;
+    search->rows = NULL;
+}
+
+// Moves the cursor to the first match once there is one, and tells how many there are once the search
+// is done, for whichever of the two was asked for.
+void find_publish() {
+    struct finding *finding = &EC.finding;
+    if (finding->jump && EC.matches.count) {
+        EC.cursor_y = EC.matches.match[0].row;
+        EC.cursor_x = EC.matches.match[0].col;
+        finding->jump = 0;
+    }
+    if (finding->running) return;
+    if (finding->report)
+        set_status(EC.loading ? "%d incidences found so far" : "%d incidences found", EC.matches.count);
+    finding->jump = finding->report = 0;
+}
+
+// Searches the next slice of rows for EC.search and publishes its matches, finishing the search at the
+// end of the document.
+void find_slice() {
+    struct finding *finding = &EC.finding;
+    int to = EC.document_rows - finding->next > FIND_SLICE ? finding->next + FIND_SLICE : EC.document_rows;
+    find(&EC.search, NULL, finding->next, to, &EC.matches);
+    finding->next = to;
+    if (to == EC.document_rows) {
+        finding->running = 0;
+        STAT_STOP(find_time);
+        STAT_SET(find_rows, EC.document_rows);
+    }
+    find_publish();
+}
+
+// Takes the lock a slice at a time, so the editor never waits on a search for longer than that.
+void *find_main(void *argument) {
+    struct finding *finding = &EC.finding;
+    (void) argument;
+
+    pthread_mutex_lock(&EC.lock);
+    while (1) {
+        while (!finding->running)
+            pthread_cond_wait(&finding->start, &EC.lock);
+        find_slice();
+        if (!EC.redraw_pending) { // Show the matches and progress so far.
+            EC.redraw_pending = 1;
+            editor_wake();
+        }
+        pthread_mutex_unlock(&EC.lock);
+        sched_yield();
+        pthread_mutex_lock(&EC.lock);
+    }
+    return NULL;
+}
+
+// Searches the whole document for EC.search in the background, starting over if it already was.
+void find_start() {
+    struct finding *finding = &EC.finding;
+    EC.matches.count = 0;
+    finding->next = 0;
+    finding->running = 1;
+    finding->stopped = 0;
+    STAT_START(find_time);
+
+    if (!finding->started) {
+        pthread_t thread;
+        pthread_cond_init(&finding->start, NULL);
+        finding->started = pthread_create(&thread, NULL, find_main, NULL) == 0;
+        if (finding->started) pthread_detach(thread);
+    }
+    if (finding->started) pthread_cond_signal(&finding->start);
+    else while (finding->running) find_slice(); // Without a thread there's no other way.
+}
+
+// Stops a search that is still going through the document, keeping the matches found so far.
+void find_stop() {
+    struct finding *finding = &EC.finding;
+    if (!finding->running) return;
+    finding->running = finding->jump = finding->report = 0;
+    finding->stopped = 1;
+    STAT_STOP(find_time);
+    STAT_SET(find_rows, finding->next);
+}
+
+// Index of the first match at or after the given position.
+int matches_find(struct matches *matches, int row, int col) {
+    int low = 0, high = matches->count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        struct match *match = &matches->match[middle];
+        if (match->row < row || (match->row == row && match->col < col)) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+// Runs a search for the session kept in EC, so its results can be walked and kept up to date. It goes
+// through the document in the background, moving the cursor to the first match and telling how many
+// there are when asked to. A plain string extending a previous one that got to the end only needs to
+// look at the rows that matched, which is done right away.
+int search_update(char *pattern, int jump, int report) {
+    struct finding *finding = &EC.finding;
+    struct search search;
+    if (!EC.search.literal || strcmp(EC.search.literal, pattern) != 0 || finding->stopped) {
+        if (search_compile(&search, pattern) == -1) return -1;
+
+        int *rows = NULL, row_count = 0;
+        if (EC.search.literal && !EC.search.compiled && !search.compiled && !finding->running &&
+            !finding->stopped && strncmp(pattern, EC.search.literal, EC.search.literal_size) == 0) {
+            rows = malloc(sizeof(int) * (EC.matches.count + 1));
+            for (int j = 0; j < EC.matches.count; ++j)
+                if (row_count == 0 || rows[row_count - 1] != EC.matches.match[j].row)
+                    rows[row_count++] = EC.matches.match[j].row;
+        }
+
+        find_stop();
+        search_free(&EC.search);
+        EC.search = search;
+        if (rows) {
+            STAT_START(find_time);
+            EC.matches.count = 0;
+            find(&EC.search, rows, 0, row_count, &EC.matches);
+            finding->stopped = 0;
+            STAT_STOP(find_time);
+            STAT_SET(find_rows, row_count);
+            free(rows);
+        } else {
+            find_start();
+        }
+    }
+    finding->jump = jump;
+    finding->report = report;
+    find_publish();
+    return 0;
+}
+
+// Replaces the session's matches in row i after its content changed.
+void search_row_changed(int i) {
+    struct matches *matches = &EC.matches, found = {NULL, 0, 0};
+    if (!EC.search.literal || i < 0 || i >= EC.document_rows) return;
+    if (EC.finding.running && i >= EC.finding.next) return; // Its turn comes.
+
+    document_row *row = row_at(i);
+    if (EC.search.compiled) row_find(&EC.search.compiled[0], row, i, &found);
+    else rows_find_literal(&EC.search, row, 1, i, &found);
+
+    int from = matches_find(matches, i, 0), to = matches_find(matches, i + 1, 0);
+    int count = matches->count - (to - from) + found.count;
+    if (from == to && !found.count) return; // Nothing there before or after.
+    if (count > matches->capacity) {
+        matches->capacity = count;
+        matches->match = realloc(matches->match, sizeof(struct match) * count);
+    }
+    memmove(&matches->match[from + found.count], &matches->match[to], sizeof(struct match) * (matches->count - to));
+    if (found.count) memcpy(&matches->match[from], found.match, sizeof(struct match) * found.count);
+    matches->count = count;
+    free(found.match);
+}
+
+// Shifts the session's matches after rows were inserted at i (delta > 0) or removed from it (delta < 0).
+void search_rows_moved(int i, int delta) {
+    struct matches *matches = &EC.matches;
+    struct finding *finding = &EC.finding;
+    if (!EC.search.literal) return;
+    if (finding->running && finding->next > i) finding->next = finding->next + delta < i ? i : finding->next + delta;
+
+    int from = matches_find(matches, i, 0), to = delta < 0 ? matches_find(matches, i - delta, 0) : from;
+    memmove(&matches->match[from], &matches->match[to], sizeof(struct match) * (matches->count - to));
+    matches->count -= to - from;
+    for (int j = from; j < matches->count; ++j)
+        matches->match[j].row += delta;
+}
+
+// Moves the cursor to the next match of the session after it (or the previous one before it), wrapping
+// around the document.
+void search_jump(int direction) {
+    struct matches *matches = &EC.matches;
+    if (!EC.search.literal) {
+        set_status("Nothing to jump to! - find [a-zA-Z1-9]");
+        return;
+    }
+    if (!matches->count) {
+        set_status(EC.finding.running ? "No incidences of %s so far" : "No incidences of %s", EC.search.literal);
+        return;
+    }
+
+    int j = matches_find(matches, EC.cursor_y, EC.cursor_x + (direction > 0)) - (direction < 0);
+    j = (j + matches->count) % matches->count;
+    EC.cursor_y = matches->match[j].row;
+    EC.cursor_x = matches->match[j].col;
+    set_status("Incidence %d of %d", j + 1, matches->count);
+}
+
+int is_find_command(char *command) {
+    return strcmp(command, "find") == 0 || strcmp(command, "f") == 0 || strcmp(command, "regex") == 0;
+}
+
+// Searches while a find command is being typed, showing the first incidence of what's there so far.
+void find_preview(char *request) {
+    char copy[strlen(request) + 1];
+    char *command = strtok(strcpy(copy, request), " "), *pattern = strtok(NULL, " ");
+
+    if (!command || !is_find_command(command) || !pattern) return;
+    search_update(pattern, 1, 0);
 }
 
 /*** Input functions ***/
-char *show_prompt(char *prompt) {
+// Reads a line at the bottom of the screen. The callback, when given, sees the text after every change.
+char *show_prompt(char *prompt, void (*callback)(char *buffer)) {
     size_t size = 128, current_size = 0;
     char *buffer = malloc(size);
     buffer[0] = '\0';
@@ -395,24 +2444,30 @@ char *show_prompt(char *prompt) {
             return NULL;
         } else if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
             if (current_size != 0) buffer[--current_size] = '\0';
+            if (callback) callback(buffer);
         } else if (c == '\r') {
             if (current_size != 0) { // When the user presses enter, return the prompt content.
                 set_status("");
                 return buffer;
             }
-        } else if (!iscntrl(c) && c < 128) { // Make sure to avoid reacting to any escape sequence.
-            if (current_size == size - 1) {
-                size *= 2;
+        } else if (c == PASTE_KEY || (c < 128 && !iscntrl(c))) { // Make sure to avoid reacting to any escape sequence.
+            char key = c, *text = c == PASTE_KEY ? EC.paste.text : &key;
+            size_t length = c == PASTE_KEY ? EC.paste.size : 1, k;
+            for (k = 0; k < length && (unsigned char) text[k] >= ' ' && text[k] != 127; ++k); // Up to a line break.
+            if (current_size + k >= size) {
+                while (current_size + k >= size) size *= 2;
                 buffer = realloc(buffer, size);
             }
-            buffer[current_size++] = c;
+            memcpy(&buffer[current_size], text, k);
+            current_size += k;
             buffer[current_size] = '\0';
+            if (callback) callback(buffer);
         }
     }
 }
 
 void move_cursor(int key) {
-    document_row *row = EC.cursor_y >= EC.rows ? NULL : &EC.row[EC.cursor_y];
+    document_row *row = row_at(EC.cursor_y);
     switch (key) {
         case UP:
             if (EC.cursor_y != 0) --EC.cursor_y;
@@ -433,12 +2488,12 @@ void move_cursor(int key) {
                 --EC.cursor_x;
             } else if (EC.cursor_y > 0) {
                 --EC.cursor_y;
-                EC.cursor_x = EC.row[EC.cursor_y].size;
+                EC.cursor_x = row_at(EC.cursor_y)->size;
             }
             break;
     }
 
-    row = (EC.cursor_y >= EC.document_rows) ? NULL : &EC.row[EC.cursor_y];
+    row = row_at(EC.cursor_y);
     int size = row ? row->size : 0;
     if (EC.cursor_x > size) {
         EC.cursor_x = size;
@@ -446,71 +2501,94 @@ void move_cursor(int key) {
 }
 
 void process_command() {
-    char *request = show_prompt("/%s");
-    char *command = strtok(request, " ");
+    int cursor_x = EC.cursor_x, cursor_y = EC.cursor_y;
+    char *request = show_prompt("/%s", find_preview);
+    char *end = request ? request + strlen(request) : NULL, *command = request ? strtok(request, " ") : NULL;
 
-    if (strcmp(command, "save") == 0 || strcmp(command, "s") == 0) { // Save document's current state
+    if (!command) { // Cancelled, so undo wherever the search preview moved the cursor.
+        find_stop();
+        EC.cursor_x = cursor_x;
+        EC.cursor_y = cursor_y;
+    } else if (strcmp(command, "save") == 0 || strcmp(command, "s") == 0) { // Save document's current state
         save_file();
+    } else if (strcmp(command, "follow") == 0 || strcmp(command, "tail") == 0) {
+        follow_toggle();
+    } else if (strcmp(command, "replace") == 0 || strcmp(command, "r") == 0) {
+        char *pattern = strtok(NULL, " "), *replacement;
+        int limit = INT_MAX;
+        if (pattern && pattern[0] == '-' && isdigit((unsigned char) pattern[1])) {
+            if (atoi(&pattern[1]) > 0) limit = atoi(&pattern[1]);
+            pattern = strtok(NULL, " ");
+        }
+        // The rest of the line is the replacement, spaces and all. Nothing there deletes the incidences.
+        replacement = pattern ? pattern + strlen(pattern) : NULL;
+        if (replacement && replacement < end) ++replacement;
+        if (pattern) replace(pattern, replacement, limit);
+        else set_status("A pattern is required! - replace [-count] [a-z]\\(.\\) \\1");
+    } else if (strcmp(command, "sort") == 0) {
+        int numeric = 0, reverse = 0;
+        char *option;
+        while ((option = strtok(NULL, " ")) && option[0] == '-') {
+            numeric |= strchr(option, 'n') != NULL;
+            reverse |= strchr(option, 'r') != NULL;
+        }
+        if (option) set_status("Unknown option %s! - sort [-n] [-r]", option);
+        else lines_sort(numeric, reverse);
+    } else if (strcmp(command, "uniq") == 0) {
+        lines_uniq();
+    } else if (strcmp(command, "keep") == 0 || strcmp(command, "drop") == 0) {
+        char *pattern = strtok(NULL, " ");
+        if (pattern) lines_filter(pattern, command[0] == 'k');
+        else set_status("A pattern is required! - %s [a-zA-Z1-9]", command);
+    } else if (strcmp(command, "stats") == 0) {
+        stats_report();
     } else if (strcmp(command, "line") == 0 || strcmp(command, "l") == 0 || strcmp(command, "n") == 0) { // Jump to line
         int line = atoi(strtok(NULL, " "));
+        load_wait(line + 1);
         EC.cursor_y = line;
-    } else if (strcmp(command, "find") == 0 || strcmp(command, "f") == 0 || strcmp(command, "regex") == 0) { // Regular expression                                                         
+    } else if (is_find_command(command)) { // Regular expression
         char *pattern = strtok(NULL, " ");
 
         if (pattern) {
-            int incidences = 0;
-            for (int i = EC.document_rows - 2; i >= 0; --i) {
-                document_row *row = &EC.row[i];
-
-                regex_t preg;
-                int row_max_matches = 100;
-                size_t nmatch = 1;
-                regmatch_t pmatch[nmatch];      
-                regcomp(&preg, pattern, 0);      
-                char *dup = strdup(row->render_content);
-                int offset = 0;
-
-                for (int j=0; j<row_max_matches; j++) {
-                    int fflag = regexec(&preg, dup, nmatch, pmatch, 0);
-                    if (!fflag) {
-                        incidences++;
-                        EC.cursor_y = i;
-                        EC.cursor_x = pmatch[0].rm_so + offset;
-                        EC.row_offset = EC.document_rows;
-                        offset = pmatch[0].rm_eo;
-                        dup+=offset;
-                    }
-                    else if(fflag == REG_NOMATCH) {
-                        break;
-                    }
-                    else {
-                        set_status("Regular expression error");
-                        break;
-                    }
-                }
-                regfree(&preg);
-            }
-            set_status("%d incidences found", incidences);
+            if (search_update(pattern, 1, 1) == -1) set_status("Regular expression error");
+            else if (EC.finding.running) set_status("Searching for %s, Esc to stop", pattern);
+            if (EC.matches.count) EC.row_offset = EC.document_rows; // Bring the first one to the top.
         } else {
             set_status("A query is required! - find [a-zA-Z1-9]");
         }
     } else {
         set_status("Command not found! Visit the docs at https://github.com/oscardavidrm/red");
     }
+    free(request);
 }
 
 void process_key() {
     int c = read_key();
+    if (c != REDRAW_KEY) EC.finding.jump = 0; // Whatever the user does next, the cursor is theirs.
     switch (c) { // Switch between editor modes and I/O operations.
+        case REDRAW_KEY:
+            return;
+        case '\x1b':
+            if (!EC.finding.running) break;
+            find_stop();
+            set_status("Search stopped, %d incidences found so far", EC.matches.count);
+            return;
         case CTRL_KEY('r'):
             EC.mode = READ_MODE;
             return;
         case CTRL_KEY('e'):
-            EC.mode = EDIT_MODE;
+            if (lines_ready()) EC.mode = EDIT_MODE;
             return;
         case CTRL_KEY('c'):
             process_command();
             return;
+        case CTRL_KEY('n'):
+        case CTRL_KEY('p'):
+            search_jump(c == CTRL_KEY('n') ? 1 : -1);
+            return;
+        case CTRL_KEY('t'):
+            stats_toggle();
+            return;
         case CTRL_KEY('q'):
             clear_and_reposition_cursor();
             exit(0);
@@ -521,14 +2599,14 @@ void process_key() {
             EC.cursor_x = 0;
             return;
         case END_KEY:
-            if (EC.cursor_y < EC.document_rows) EC.cursor_x = EC.row[EC.cursor_y].size;
+            if (EC.cursor_y < EC.document_rows) EC.cursor_x = row_at(EC.cursor_y)->size;
             return;
         case PAGE_UP:
         case PAGE_DOWN: {
             if (c == PAGE_UP) {
                 EC.cursor_y = EC.row_offset;
             } else {
-                EC.cursor_y = EC.row_offset + EC.document_rows - 1;
+                EC.cursor_y = EC.row_offset + EC.rows - 1;
                 if (EC.cursor_y > EC.document_rows) EC.cursor_y = EC.document_rows;
             }
 
@@ -547,6 +2625,9 @@ void process_key() {
 
     if (EC.mode == EDIT_MODE) { // Edit operations
         switch (c) {
+            case PASTE_KEY:
+                insert_text(EC.paste.text, EC.paste.size);
+                break;
             case '\r':
                 insert_new_line();
                 break;
@@ -565,199 +2646,1452 @@ void process_key() {
 }
 
 /*** File functions ***/
+// Brings what is built on top of rows, the trigram index and the last search, up to date with row i.
+void row_changed(int i) {
+    index_row(i);
+    search_row_changed(i);
+    syntax_invalidate(i);
+}
+
 void row_append(int i, char *line, size_t size) {
     if (i < 0 || i > EC.document_rows) return;
 
-    EC.row = realloc(EC.row, sizeof(document_row) * (EC.document_rows + 1));
-    memmove(&EC.row[i + 1], &EC.row[i], sizeof(document_row) * (EC.document_rows - i));
+    document_row *row = row_insert(i);
+    row->size = size;
+    row->content = malloc(content_capacity(size));
+    STAT_HELD(row_bytes, row->content);
+    memcpy(row->content, line, size);
+    row->content[size] = '\0';
+    row->render_size = row->render_start = row->render_capacity = row->column_count = row->state_count = 0;
+    row->state_in = row->state_out = row->states_from = LEX_UNKNOWN;
+    row->render_content = NULL;
+    row->columns = NULL;
+    row->highlight = NULL;
+    row->cache = NULL;
+    row->flags = ROW_STALE;
+    ++EC.document_rows;
+    search_rows_moved(i, 1);
+    syntax_rows_moved(i, 1);
+    rendered_rows_moved(i, 1);
+    row_changed(i);
+}
+
+// Gives a borrowed row its own heap copy before it gets modified (copy-on-write).
+void row_own(document_row *row) {
+    if (!(row->flags & ROW_BORROWED)) return;
 
-    EC.row[i].size = size;
-    EC.row[i].content = malloc(size + 1);
-    memcpy(EC.row[i].content, line, size);
-    EC.row[i].content[size] = '\0';
-    EC.row[i].render_size = 0;
-    EC.row[i].render_content = NULL;
-    EC.row[i].highlight = NULL;
+    char *content = malloc(content_capacity(row->size));
+    STAT_HELD(row_bytes, content);
+    memcpy(content, row->content, row->size);
+    content[row->size] = '\0';
+    row->content = content;
+    row->flags &= ~ROW_BORROWED;
+}
 
-    row_append_render(&EC.row[i]);
-    ++EC.document_rows;
+// Bytes allocated for the content of an owned row. Long rows grow by doubling so typing into them
+// doesn't copy the whole row on every key.
+size_t content_capacity(size_t size) {
+    if (size < LONG_ROW) return size + 1;
+    size_t capacity = LONG_ROW;
+    while (capacity < size + 1) capacity *= 2;
+    return capacity;
 }
 
-void row_append_render(document_row *row) {
-    int i, tabs = 0;
+// Marks a row as changed from byte i on.
+void row_edited(document_row *row, int i) {
+    row->flags |= ROW_STALE; // Rendered when next drawn.
+    if (row->column_count > i / COLUMN_STRIDE + 1) row->column_count = i / COLUMN_STRIDE + 1;
+    if (row->state_count > i / COLUMN_STRIDE + 1) row->state_count = i / COLUMN_STRIDE + 1;
+}
 
-    for (i = 0; i < row->size; ++i)
-        tabs += row->content[i] == '\t' ? 1 : 0;
+// Render column reached after the bytes in [p, end) when they start at the given column.
+int columns_advance(char *p, char *end, int column) {
+    for (char *tab; (tab = memchr(p, '\t', end - p)); p = tab + 1)
+        column = (column + (tab - p)) / TAB_STOP * TAB_STOP + TAB_STOP;
+    return column + (end - p);
+}
 
-    free(row->render_content);
-    row->render_content = malloc(row->size + tabs * (TAB_STOP - 1) + 1);
+// Makes room for checkpoints up to k, keeping the ones still valid.
+void row_checkpoints_reserve(document_row *row, int k) {
+    if (k >= row->column_count && k >= row->state_count)
+        row->columns = realloc(row->columns, sizeof(struct checkpoint) * (k + 1));
+}
 
-    int render_size = 0;
-    for (i = 0; i < row->size; ++i) {
-        if (row->content[i] == '\t') {
-            row->render_content[render_size++] = ' ';
-            while (render_size % TAB_STOP != 0) row->render_content[render_size++] = ' ';
-        } else {
-            row->render_content[render_size++] = row->content[i];
+// Render column at byte k * COLUMN_STRIDE of a long row, extending the column index up to it.
+int row_checkpoint(document_row *row, int k) {
+    if (k >= row->column_count) {
+        row_checkpoints_reserve(row, k);
+        if (row->column_count == 0) row->columns[row->column_count++].column = 0;
+        for (; row->column_count <= k; ++row->column_count) {
+            char *p = &row->content[(row->column_count - 1) * COLUMN_STRIDE];
+            int column = row->columns[row->column_count - 1].column;
+            row->columns[row->column_count].column = columns_advance(p, p + COLUMN_STRIDE, column);
+        }
+    }
+    return row->columns[k].column;
+}
+
+// Lexer state at byte k * COLUMN_STRIDE of a long row starting in the given state, extending the
+// checkpoints up to it. Edits only redo them from the mark before the change.
+unsigned char row_state_checkpoint(document_row *row, unsigned char state, int k) {
+    if (row->states_from != state) {
+        row->states_from = state;
+        row->state_count = 0;
+    }
+    if (k >= row->state_count) {
+        row_checkpoints_reserve(row, k);
+        if (row->state_count == 0) row->columns[row->state_count++].state = state;
+        for (; row->state_count <= k; ++row->state_count) {
+            char *p = &row->content[(row->state_count - 1) * COLUMN_STRIDE];
+            unsigned char from = row->columns[row->state_count - 1].state;
+            row->columns[row->state_count].state = syntax_scan(&EC.syntax, from, p, COLUMN_STRIDE);
+        }
+    }
+    return row->columns[k].state;
+}
+
+// Lexer state after the first x bytes of a row starting in the given state, from the nearest
+// checkpoint in long rows.
+unsigned char row_state_at(document_row *row, unsigned char state, int x) {
+    int from = 0;
+    if (row->size >= LONG_ROW) {
+        from = x / COLUMN_STRIDE * COLUMN_STRIDE;
+        state = row_state_checkpoint(row, state, x / COLUMN_STRIDE);
+    }
+    return syntax_scan(&EC.syntax, state, &row->content[from], x - from);
+}
+
+// Render column of byte x, found from the nearest checkpoint in long rows.
+int row_render_x(document_row *row, int x) {
+    int from = 0, column = 0;
+    if (row->size >= LONG_ROW) {
+        from = x / COLUMN_STRIDE * COLUMN_STRIDE;
+        column = row_checkpoint(row, x / COLUMN_STRIDE);
+    }
+    return columns_advance(&row->content[from], &row->content[x], column);
+}
+
+// Byte of the character covering render column col, or the size of the row when it's shorter. The
+// column that character starts at goes to start, as a tab covers several.
+int row_byte_at(document_row *row, int col, int *start) {
+    int k = 0, column = 0, x;
+    if (row->size >= LONG_ROW) {
+        int last = row->size / COLUMN_STRIDE, high = row->column_count ? row->column_count - 1 : 0;
+        while (high < last && row_checkpoint(row, high) <= col) ++high;
+        row_checkpoint(row, high);
+        while (k < high) { // Last checkpoint at or before col.
+            int middle = (k + high + 1) / 2;
+            if (row->columns[middle].column <= col) k = middle;
+            else high = middle - 1;
         }
+        column = row->columns[k].column;
+    }
+
+    for (x = k * COLUMN_STRIDE; x < row->size; ++x) {
+        int next = row->content[x] == '\t' ? column / TAB_STOP * TAB_STOP + TAB_STOP : column + 1;
+        if (next > col) break;
+        column = next;
+    }
+    *start = column;
+    return x;
+}
+
+// Computes render_content and highlight when a row is shown, starting in the given lexer state. Long
+// rows only get the columns around the screen, and again whenever it scrolls away from them.
+void row_prepare(document_row *row, unsigned char state) {
+    if (row->state_in != state) row->flags |= ROW_STALE;
+    row->state_in = state;
+    if (row->size < LONG_ROW) {
+        if (row->flags & ROW_STALE) row_append_render(row, 0, INT_MAX);
+        return;
+    }
+
+    int from = EC.col_offset, to = EC.col_offset + EC.cols;
+    if (!(row->flags & ROW_STALE) && row->render_start <= from &&
+        (to <= row->render_start + row->render_size || !(row->flags & ROW_CLIPPED)))
+        return;
+    row_append_render(row, from > RENDER_MARGIN ? from - RENDER_MARGIN : 0, to + RENDER_MARGIN);
+}
+
+// Renders columns [from, to) of a row, starting a little early when a tab straddles from.
+void row_append_render(document_row *row, int from, int to) {
+    int start, x = row_byte_at(row, from, &start), column = start, render_size = 0;
+    char *p = &row->content[x], *end = row->content + row->size, *tab;
+    size_t capacity;
+
+    row->flags &= ~(ROW_STALE | ROW_CLIPPED);
+    if (to == INT_MAX) { // The whole row, so count its tabs to know how far they stretch it.
+        int tabs = 0;
+        for (tab = memchr(p, '\t', end - p); tab; tab = memchr(tab + 1, '\t', end - tab - 1))
+            ++tabs;
+        capacity = end - p + tabs * (TAB_STOP - 1) + 1;
+    } else {
+        capacity = to - start + TAB_STOP;
+    }
+
+    if (!row->render_content && EC.spare_count) { // Take over what a row that went away let go of.
+        struct render_buffers *spare = &EC.spare[--EC.spare_count];
+        row->render_content = spare->content;
+        row->highlight = spare->highlight;
+        row->cache = spare->cache;
+        row->render_capacity = spare->capacity;
+    }
+    if (capacity > (size_t) row->render_capacity) {
+        if (capacity < (size_t) row->render_capacity * 2) capacity = row->render_capacity * 2; // Typing grows rows.
+        row->render_capacity = capacity;
+        STAT_RELEASED(render_bytes, row->render_content);
+        STAT_RELEASED(highlight_bytes, row->highlight);
+        free(row->render_content);
+        free(row->highlight);
+        row->render_content = malloc(row->render_capacity);
+        row->highlight = malloc(row->render_capacity);
+        STAT_HELD(render_bytes, row->render_content);
+        STAT_HELD(highlight_bytes, row->highlight);
+    }
+
+    // Text between tabs is copied whole, so a row without them is a single copy.
+    while (p < end && column < to) {
+        size_t left = end - p < (long) to - column ? (size_t) (end - p) : (size_t) to - column;
+        tab = memchr(p, '\t', left);
+        char *run_end = tab ? tab : p + left;
+        memcpy(&row->render_content[render_size], p, run_end - p);
+        render_size += run_end - p;
+        column += run_end - p;
+        p = run_end;
+        if (!tab) continue;
+        do row->render_content[render_size++] = ' '; while (++column % TAB_STOP != 0);
+        p = tab + 1;
     }
+    if (p < end) row->flags |= ROW_CLIPPED;
 
     row->render_content[render_size] = '\0';
+    row->render_start = start;
     row->render_size = render_size;
-    row_set_syntax(row);
+    // Tabs leave the lexer where spaces would, so the bytes before the columns tell where they start.
+    row_set_syntax(row, x && EC.syntax.rules ? row_state_at(row, row->state_in, x) : row->state_in);
 }
 
 void row_append_string(document_row *row, char *c, size_t size) {
-    row->content = realloc(row->content, row->size + size + 1);
+    row_own(row);
+    row_edited(row, row->size);
+    if (row->size + size + 1 > content_capacity(row->size)) {
+        STAT_RELEASED(row_bytes, row->content);
+        row->content = realloc(row->content, content_capacity(row->size + size));
+        STAT_HELD(row_bytes, row->content);
+    }
     memcpy(&row->content[row->size], c, size);
     row->size += size;
     row->content[row->size] = '\0';
-    row_append_render(row);
+}
+
+// Lets go of what's worked out from the content to show the row, which is done again when it's next
+// drawn. The buffers go to the next row shown, so scrolling reuses the same few screens' worth.
+void row_release(document_row *row) {
+    if (row->render_content || row->cache) {
+        if (EC.spare_count == EC.spare_capacity) {
+            EC.spare_capacity = EC.spare_capacity ? EC.spare_capacity * 2 : 64;
+            EC.spare = realloc(EC.spare, sizeof(struct render_buffers) * EC.spare_capacity);
+        }
+        EC.spare[EC.spare_count++] =
+            (struct render_buffers) {row->render_content, row->highlight, row->cache, row->render_capacity};
+    }
+    row->render_content = NULL;
+    row->highlight = NULL;
+    row->cache = NULL;
+    row->render_size = row->render_start = row->render_capacity = 0;
+    row->flags = (row->flags | ROW_STALE) & ~ROW_CLIPPED;
 }
 
 void row_free(document_row *row) {
-    free(row->content);
-    free(row->render_content);
-    free(row->highlight);
+    if (!(row->flags & ROW_BORROWED)) {
+        STAT_RELEASED(row_bytes, row->content);
+        free(row->content);
+    }
+    free(row->columns);
+    row_release(row);
 }
 
 void row_delete(int i) {
     if (i < 0 || i >= EC.document_rows) return;
-    row_free(&EC.row[i]);
-    memmove(&EC.row[i], &EC.row[i + 1], sizeof(document_row) * (EC.document_rows - i - 1));
+    row_free(row_at(i));
+    row_remove(i);
     --EC.document_rows;
+    search_rows_moved(i, -1);
+    syntax_rows_moved(i, -1);
+    rendered_rows_moved(i, -1);
 }
 
 void row_insert_char(document_row *row, int i, int c) {
     if (i < 0 || i > row->size) i = row->size;
-    row->content = realloc(row->content, row->size + 2);
+    row_own(row);
+    if (row->size + 2 > (int) content_capacity(row->size)) {
+        STAT_RELEASED(row_bytes, row->content);
+        row->content = realloc(row->content, content_capacity(row->size + 1));
+        STAT_HELD(row_bytes, row->content);
+    }
     memmove(&row->content[i + 1], &row->content[i], row->size - i + 1);
     ++row->size;
     row->content[i] = c;
-    row_append_render(row);
+    row_edited(row, i);
 }
 
 void insert_char(int c) {
     if (EC.cursor_y == EC.document_rows) // If cursor is at the end of the file, append a new row.
         row_append(EC.document_rows, "", 0);
-    row_insert_char(&EC.row[EC.cursor_y], EC.cursor_x, c);
+    row_insert_char(row_at(EC.cursor_y), EC.cursor_x, c);
+    row_changed(EC.cursor_y);
     ++EC.cursor_x;
 }
 
 void row_delete_char(document_row *row, int i) {
     if (i < 0 || i > row->size) return;
+    row_own(row);
     memmove(&row->content[i], &row->content[i + 1], row->size - i);
     --row->size;
-    row_append_render(row);
+    row_edited(row, i);
 }
 
 void delete_char() {
     if (EC.cursor_y == EC.document_rows) return;
     if (EC.cursor_x == 0 && EC.cursor_y == 0) return;
 
-    document_row *row = &EC.row[EC.cursor_y];
+    document_row *row = row_at(EC.cursor_y);
     if (EC.cursor_x > 0) {
         row_delete_char(row, EC.cursor_x - 1);
+        row_changed(EC.cursor_y);
         --EC.cursor_x;
     } else {
-        EC.cursor_x = EC.row[EC.cursor_y - 1].size;
-        row_append_string(&EC.row[EC.cursor_y - 1], row->content, row->size);
+        document_row *previous = row_at(EC.cursor_y - 1);
+        EC.cursor_x = previous->size;
+        row_append_string(previous, row->content, row->size);
         row_delete(EC.cursor_y);
         --EC.cursor_y;
+        row_changed(EC.cursor_y);
+    }
+}
+
+// Copies bytes of the mapping to fd, letting the kernel take them straight from the source file.
+int map_copy(int fd, char *from, char *to) {
+    loff_t offset = from - EC.map;
+    while (from < to && EC.map_fd != -1) {
+        ssize_t copied = copy_file_range(EC.map_fd, &offset, fd, NULL, to - from, 0);
+        if (copied == -1 && errno == EINTR) continue;
+        if (copied <= 0) break; // Not supported across these files, so the rest goes through write.
+        from += copied;
+    }
+    while (from < to) {
+        ssize_t written = write(fd, from, to - from);
+        if (written == -1 && errno == EINTR) continue;
+        if (written == -1) return -1;
+        from += written;
+    }
+    return 0;
+}
+
+// Writes out a range of the mapping. A short one joins the batch, as a copy_file_range call of its own
+// would cost more than the copy it saves. A long one is copied by the kernel once the batch is out.
+int run_write(int fd, struct buffer *out, size_t *queued, char *run, char *run_end) {
+    if (run_end - run >= COPY_MIN) {
+        if (out->iov_count && buffer_flush(out, fd) == -1) return -1;
+        *queued = 0;
+        return map_copy(fd, run, run_end);
     }
+    buffer_reference(out, run, run_end - run);
+    *queued += run_end - run;
+    if (*queued < SAVE_BATCH) return 0;
+    *queued = 0;
+    return buffer_flush(out, fd);
 }
 
-char *rows_to_string(int *buff_size) {
-    int size = 0, i;
-    for (i = 0; i < EC.document_rows; ++i)
-        size += EC.row[i].size + 1;
-    *buff_size = size;
+// Streams the document to fd. Consecutive borrowed rows still followed by their newline read exactly
+// as they do in the file, so they're written from it as one range. Everything else is batched into
+// writev calls, which keeps memory use flat however big the document is.
+int rows_write(int fd, size_t *size) {
+    struct buffer out = BUFFER_INIT;
+    char *run = NULL, *run_end = NULL; // Range of the mapping waiting to be written.
+    int i, j, count, error = 0;
+    size_t queued = 0;
 
-    char *buffer = malloc(size);
-    char *current_row = buffer;
-    for (i = 0; i < EC.document_rows; ++i) {
-        memcpy(current_row, EC.row[i].content, EC.row[i].size);
-        current_row += EC.row[i].size;
-        *current_row = '\n';
-        ++current_row;
+    *size = 0;
+    for (i = 0; i < EC.document_rows && !error; i += count) {
+        document_row *row = row_span(i, &count);
+        for (j = 0; j < count && !error; ++j) {
+            char *end = row[j].content + row[j].size;
+            int whole = (row[j].flags & ROW_BORROWED) && row[j].content >= EC.map && end < EC.map + EC.map_size &&
+                        *end == '\n';
+            *size += row[j].size + 1;
+
+            if (whole && run && row[j].content == run_end) {
+                run_end = end + 1;
+                continue;
+            }
+            if (run) error = run_write(fd, &out, &queued, run, run_end);
+            run = NULL;
+            if (whole) {
+                run = row[j].content;
+                run_end = end + 1;
+                continue;
+            }
+
+            buffer_reference(&out, row[j].content, row[j].size);
+            buffer_append(&out, "\n", 1);
+            queued += row[j].size + 1;
+            if (queued >= SAVE_BATCH) {
+                error = buffer_flush(&out, fd);
+                queued = 0;
+            }
+        }
+    }
+    if (!error && run) error = run_write(fd, &out, &queued, run, run_end);
+    if (!error && out.iov_count) error = buffer_flush(&out, fd);
+    buffer_free(&out);
+    return error;
+}
+
+// Flushes the directory a file was just renamed into, without which a crash could still bring back the
+// old file.
+int directory_sync(const char *path) {
+    const char *slash = strrchr(path, '/');
+    int length = slash ? (slash == path ? 1 : slash - path) : 1;
+    char directory[length + 1];
+    memcpy(directory, slash ? path : ".", length);
+    directory[length] = '\0';
+
+    int fd = open(directory, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) return -1;
+    int error = fsync(fd);
+    close(fd);
+    return error;
+}
+
+// Inserts text at the cursor in one go, changing every row it touches once. Line breaks may be \n, \r
+// or \r\n, as terminals send them either way.
+void insert_text(char *text, size_t size) {
+    if (EC.cursor_y == EC.document_rows) row_append(EC.document_rows, "", 0);
+
+    // What follows the cursor is moved to the end of the inserted text.
+    document_row *row = row_at(EC.cursor_y);
+    row_own(row);
+    size_t tail_size = row->size - EC.cursor_x;
+    char *end = text + size, *line = text, *line_end, *last = malloc(size + tail_size + 1);
+    memcpy(last, &row->content[EC.cursor_x], tail_size);
+    row->size = EC.cursor_x;
+
+    int y = EC.cursor_y;
+    for (;;) {
+        for (line_end = line; line_end < end && *line_end != '\n' && *line_end != '\r'; ++line_end);
+        if (line_end == end) break;
+        if (y == EC.cursor_y) {
+            row_append_string(row_at(y), line, line_end - line);
+            row_changed(y);
+        } else {
+            row_append(y, line, line_end - line);
+        }
+        ++y;
+        line = line_end + (line_end[0] == '\r' && line_end + 1 < end && line_end[1] == '\n' ? 2 : 1);
     }
 
-    return buffer;
+    size_t last_size = end - line;
+    memmove(&last[last_size], last, tail_size);
+    memcpy(last, line, last_size);
+    if (y == EC.cursor_y) {
+        EC.cursor_x += last_size;
+        row_append_string(row_at(y), last, last_size + tail_size);
+        row_changed(y);
+    } else {
+        EC.cursor_x = last_size;
+        row_append(y, last, last_size + tail_size);
+    }
+    EC.cursor_y = y;
+    free(last);
 }
 
 void insert_new_line() {
     if (EC.cursor_x == 0) {
         row_append(EC.cursor_y, "", 0);
     } else {
-        document_row *row = &EC.row[EC.cursor_y];
+        document_row *row = row_at(EC.cursor_y);
         row_append(EC.cursor_y + 1, &row->content[EC.cursor_x], row->size - EC.cursor_x);
-        row = &EC.row[EC.cursor_y];
+        row = row_at(EC.cursor_y);
+        row_own(row);
         row->size = EC.cursor_x;
         row->content[row->size] = '\0';
-        row_append_render(row);
+        row_edited(row, row->size);
+        row_changed(EC.cursor_y);
     }
 
     ++EC.cursor_y;
     EC.cursor_x = 0;
 }
 
+// Builds rows pointing straight into a read-only file mapping. Rows get their own copy on first edit.
+// Collects the offsets of the newlines in the first size bytes of p, a vector at a time when possible.
+int newlines_find(char *p, int size, int *offsets) {
+    int count = 0, i = 0;
+#if defined(__AVX2__)
+    __m256i newline = _mm256_set1_epi8('\n');
+    for (; i + 32 <= size; i += 32) {
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(newline, _mm256_loadu_si256((__m256i *) &p[i])));
+        for (; mask; mask &= mask - 1)
+            offsets[count++] = i + __builtin_ctz(mask);
+    }
+#elif defined(__SSE2__)
+    __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= size; i += 16) {
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(newline, _mm_loadu_si128((__m128i *) &p[i])));
+        for (; mask; mask &= mask - 1)
+            offsets[count++] = i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < size; ++i)
+        if (p[i] == '\n') offsets[count++] = i;
+    return count;
+}
+
+// Builds a row from a line without its newline. Borrowed lines point into a buffer that outlives them,
+// anything else gets its own copy.
+void row_init(document_row *row, char *line, size_t size, int borrow) {
+    while (size > 0 && line[size - 1] == '\r')
+        size--;
+
+    if (borrow) {
+        row->content = line;
+    } else {
+        row->content = malloc(content_capacity(size));
+        STAT_HELD(row_bytes, row->content);
+        memcpy(row->content, line, size);
+        row->content[size] = '\0';
+    }
+    row->size = size;
+    row->render_size = row->render_start = row->render_capacity = row->column_count = row->state_count = 0;
+    row->state_in = row->state_out = row->states_from = LEX_UNKNOWN;
+    row->render_content = NULL;
+    row->columns = NULL;
+    row->highlight = NULL;
+    row->cache = NULL;
+    row->flags = borrow ? ROW_BORROWED | ROW_STALE : ROW_STALE;
+}
+
+void row_load(row_node **chunk, char *line, size_t size, int borrow) {
+    row_init(rows_next(chunk), line, size, borrow);
+}
+
+// Builds the rows of a chunk from its bytes. A file changed behind the line index's back may not have
+// the lines it promised, in which case the chunk still gets its rows, empty or cut short.
+void node_fill(row_node *node) {
+    char *p = node->text, *end = p + node->text_size, *newline;
+    for (int k = 0; k < node->size; ++k) {
+        newline = p < end ? memchr(p, '\n', end - p) : NULL;
+        if (k == node->size - 1 || !newline) newline = end > p && end[-1] == '\n' ? end - 1 : end;
+        row_init(&node->row[k], p, newline - p, 1);
+        p = newline < end ? newline + 1 : end;
+    }
+    EC.load_progress += node->text_size;
+    node->text = NULL;
+}
+
+// Loads every complete line in the buffer, returning how many bytes that took. Newlines are only looked
+// for from the given offset on, and a trailing line without its newline is left for the caller.
+size_t rows_load(row_node **chunk, char *p, size_t from, size_t size, int borrow) {
+    int offsets[LOAD_BLOCK];
+    size_t block, start = 0;
+
+    for (block = from; block < size; block += LOAD_BLOCK) {
+        int count = newlines_find(&p[block], size - block < LOAD_BLOCK ? size - block : LOAD_BLOCK, offsets);
+        for (int k = 0; k < count; ++k) {
+            size_t newline = block + offsets[k];
+            row_load(chunk, &p[start], newline - start, borrow);
+            start = newline + 1;
+        }
+    }
+    return start;
+}
+
+// Waits, with the document lock held, until the given number of rows is loaded or loading is done.
+void load_wait(int rows) {
+    while (EC.loading && EC.document_rows < rows)
+        pthread_cond_wait(&EC.loaded, &EC.lock);
+}
+
+// Hashes a few spread out samples of the mapping, enough to tell a rewritten file from the one a line
+// index was made for.
+uint64_t map_checksum() {
+    uint64_t hash = 14695981039346656037u;
+    for (size_t k = 0; k <= 64; ++k) {
+        size_t at = (EC.map_size - 1) / 64 * k, end = at + 64 < EC.map_size ? at + 64 : EC.map_size;
+        for (; at < end; ++at)
+            hash = (hash ^ (unsigned char) EC.map[at]) * 1099511628211u;
+    }
+    return hash;
+}
+
+// The line index of dir/name lives in dir/.name.lines.
+char *line_index_path(char *file_name) {
+    char *slash = strrchr(file_name, '/'), *path = malloc(strlen(file_name) + 8);
+    int dir = slash ? slash - file_name + 1 : 0;
+    sprintf(path, "%.*s.%s.lines", dir, file_name, &file_name[dir]);
+    return path;
+}
+
+// Lays the document out as chunks straight from a line index without looking at their bytes, which
+// node_fill does when they're first needed. Returns 0 when there is no index or it's out of date.
+int line_index_read() {
+    struct line_index header;
+    char *path = line_index_path(EC.file_name);
+    FILE *file = fopen(path, "r");
+    free(path);
+    if (!file) return 0;
+
+    int valid = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, LINE_INDEX_MAGIC, 8) == 0 &&
+            header.size == EC.map_size && header.mtime_sec == (uint64_t) EC.map_time.tv_sec &&
+            header.mtime_nsec == (uint64_t) EC.map_time.tv_nsec && header.stride == ROW_CHUNK &&
+            header.lines > 0 && header.lines <= INT_MAX && header.checksum == map_checksum();
+    size_t chunks = valid ? (header.lines + ROW_CHUNK - 1) / ROW_CHUNK : 0;
+    uint64_t *offsets = malloc(sizeof(uint64_t) * (chunks + 1));
+    valid = valid && fread(offsets, sizeof(uint64_t), chunks, file) == chunks;
+    fclose(file);
+
+    offsets[chunks] = EC.map_size;
+    for (size_t k = 0; valid && k < chunks; ++k)
+        valid = offsets[k] < offsets[k + 1] && (k > 0 || offsets[0] == 0);
+
+    for (size_t k = 0; valid && k < chunks; ++k) {
+        row_node *node = node_new();
+        node->size = k + 1 < chunks ? ROW_CHUNK : header.lines - k * ROW_CHUNK;
+        node->text = &EC.map[offsets[k]];
+        node->text_size = offsets[k + 1] - offsets[k];
+        node_update(node);
+        EC.row = node_merge(EC.row, node);
+    }
+    if (valid) {
+        EC.document_rows = header.lines;
+        syntax_invalidate(0); // The rows never went through rows_end, which would have queued them.
+    }
+    free(offsets);
+    return valid;
+}
+
+// Saves where every chunk starts right after a full load, while each one still holds ROW_CHUNK rows
+// borrowed from the mapping. The index is written aside and renamed over, so readers never see half of it.
+void line_index_write() {
+    struct line_index header = {LINE_INDEX_MAGIC, EC.map_size, EC.map_time.tv_sec, EC.map_time.tv_nsec,
+                                map_checksum(), EC.document_rows, ROW_CHUNK};
+    size_t chunks = (EC.document_rows + ROW_CHUNK - 1) / ROW_CHUNK, k;
+    uint64_t *offsets = malloc(sizeof(uint64_t) * (chunks + 1));
+    for (k = 0; k < chunks; ++k)
+        offsets[k] = row_at(k * ROW_CHUNK)->content - EC.map;
+
+    char *path = line_index_path(EC.file_name), temporary[strlen(path) + 8];
+    sprintf(temporary, "%s.XXXXXX", path);
+    int fd = mkstemp(temporary);
+    if (fd != -1) {
+        fchmod(fd, 0644);
+        FILE *file = fdopen(fd, "w");
+        int written = file && fwrite(&header, sizeof(header), 1, file) == 1 &&
+                fwrite(offsets, sizeof(uint64_t), chunks, file) == chunks;
+        if (file ? fclose(file) != 0 : close(fd) != 0) written = 0;
+        if (!written || rename(temporary, path) == -1) unlink(temporary);
+    }
+    free(path);
+    free(offsets);
+}
+
+void load_mapping() {
+    row_node *chunk = NULL;
+    char *map = EC.map;
+    size_t size = EC.map_size, start = 0, scanned, end;
+
+    for (scanned = 0; scanned < size; scanned = end) {
+        end = size - scanned > LOAD_SLICE ? scanned + LOAD_SLICE : size;
+        start += rows_load(&chunk, &map[start], scanned - start, end - start, 1);
+    }
+    if (start < size) row_load(&chunk, &map[start], size - start, 1);
+    rows_end(&chunk);
+}
+
+// Builds the chunks a line index left empty, in order, unless the editor got to them first.
+void fill_mapping() {
+    for (int i = 0, start;;) {
+        pthread_mutex_lock(&EC.lock);
+        if (i >= EC.document_rows) {
+            pthread_mutex_unlock(&EC.lock);
+            break;
+        }
+        i = start + node_find(i, &start, 0)->size;
+        pthread_mutex_unlock(&EC.lock);
+    }
+}
+
+void *load_main(void *argument) {
+    int indexed = argument != NULL;
+    if (indexed) fill_mapping();
+    else load_mapping();
+
+    pthread_mutex_lock(&EC.lock);
+    EC.loading = 0;
+    STAT_STOP(load_time);
+    pthread_cond_broadcast(&EC.loaded);
+    editor_wake();
+    if (!indexed && EC.map_size >= LINE_INDEX_MIN_SIZE) line_index_write();
+    pthread_mutex_unlock(&EC.lock);
+    return NULL;
+}
+
+// Loads the rows of a mapped file on a background thread, publishing them a chunk at a time so the
+// first screen can be drawn right away. With a line index every row is there from the start instead,
+// and the thread only builds the chunks nobody has looked at yet.
+void open_mapping(char *map, struct stat *st) {
+    pthread_t thread;
+    EC.map = map;
+    EC.map_size = st->st_size;
+    EC.map_time = st->st_mtim;
+    EC.load_progress = 0;
+    STAT_START(load_time);
+
+    int indexed = EC.map_size >= LINE_INDEX_MIN_SIZE && line_index_read();
+    EC.loading = 1;
+    if (pthread_create(&thread, NULL, load_main, indexed ? EC.map : NULL) == 0) {
+        pthread_detach(thread);
+        return;
+    }
+    EC.loading = 0;
+    if (!indexed) load_mapping();
+    for (int i = 0, start; indexed && i < EC.document_rows; i = start + node_find(i, &start, 0)->size);
+    STAT_STOP(load_time);
+}
+
+// Reads the rows coming through fd until it ends. A line cut by the end of a block is moved to the front
+// to be finished by the next one. Rows are published whenever the input runs dry, so a slow command
+// has its output shown as it goes, while a fast one is still taken in whole chunks.
+void load_stream(int fd) {
+    row_node *chunk = NULL;
+    size_t capacity = LOAD_BLOCK * 16, size = 0, loaded;
+    char *block = malloc(capacity);
+    ssize_t count;
+    for (;;) {
+        if (size == capacity) block = realloc(block, capacity *= 2);
+        count = read(fd, &block[size], capacity - size);
+        if (count == -1 && errno == EINTR) continue;
+        if (count <= 0) break;
+        EC.follow.offset += count;
+        EC.follow.open_row = block[size + count - 1] != '\n';
+
+        loaded = rows_load(&chunk, block, size, size + count, 0);
+        size += count - loaded;
+        if (loaded) memmove(block, &block[loaded], size);
+
+        struct pollfd input = {fd, POLLIN, 0};
+        if (chunk && poll(&input, 1, 0) == 0) rows_end(&chunk);
+    }
+    if (count == -1) {
+        pthread_mutex_lock(&EC.lock);
+        set_status("Can't read the rest of the input! %s", strerror(errno));
+        pthread_mutex_unlock(&EC.lock);
+    }
+    if (size) row_load(&chunk, block, size, 0);
+    rows_end(&chunk);
+
+    free(block);
+    close(fd);
+}
+
+void *stream_main(void *argument) {
+    load_stream((int) (intptr_t) argument);
+
+    pthread_mutex_lock(&EC.lock);
+    EC.loading = EC.streaming = 0;
+    STAT_STOP(load_time);
+    pthread_cond_broadcast(&EC.loaded);
+    editor_wake();
+    pthread_mutex_unlock(&EC.lock);
+    return NULL;
+}
+
+// Reads the document from fd on a background thread, so the editor is up as soon as the first rows are.
+void open_stream(int fd) {
+    pthread_t thread;
+    STAT_START(load_time);
+    EC.loading = EC.streaming = 1;
+    if (pthread_create(&thread, NULL, stream_main, (void *) (intptr_t) fd) == 0) {
+        pthread_detach(thread);
+        return;
+    }
+    EC.loading = EC.streaming = 0;
+    load_stream(fd);
+    STAT_STOP(load_time);
+}
+
 void open_file(char *file_name) {
     free(EC.file_name);
     EC.file_name = strdup(file_name);
+    syntax_select(file_name);
 
-    FILE *file = fopen(file_name, "r");
-    if (!file) editor_exit("fopen");
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) editor_exit("open");
 
-    char *line = NULL;
-    size_t capacity = 0;
-    ssize_t size;
-    while ((size = getline(&line, &capacity, file)) != -1) {
-        while (size > 0 && (line[size - 1] == '\n' || line[size - 1] == '\r'))
-            size--;
-        row_append(EC.document_rows, line, size);
+    struct stat st;
+    if (fstat(fd, &st) == -1) editor_exit("fstat");
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            EC.map_fd = fd;
+            EC.follow.offset = st.st_size;
+            EC.follow.open_row = map[st.st_size - 1] != '\n';
+            open_mapping(map, &st);
+            return;
+        }
     }
 
-    free(line);
-    fclose(file);
+    open_stream(fd); // Empty files, pipes, ...
+}
+
+// Swaps the mapping for an anonymous copy at the same address, so rows borrowing from it stay as they
+// are whatever happens to the file. Only its first readable bytes are copied, as the rest may be gone.
+void map_detach(size_t readable) {
+    if (EC.map_fd == -1) return;
+    char *copy = mmap(NULL, EC.map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (copy == MAP_FAILED) editor_exit("mmap");
+    memcpy(copy, EC.map, readable < EC.map_size ? readable : EC.map_size);
+    mprotect(copy, EC.map_size, PROT_READ);
+    if (mremap(copy, EC.map_size, EC.map_size, MREMAP_MAYMOVE | MREMAP_FIXED, EC.map) == MAP_FAILED)
+        editor_exit("mremap");
+    close(EC.map_fd);
+    EC.map_fd = -1;
+}
+
+// Drops the rows borrowing bytes past the first size of the mapping, which the file no longer has, and
+// detaches the rest before it can lose them too.
+void map_cut(size_t size) {
+    struct transform transform = {.keep = 1};
+    int lines;
+
+    load_wait(INT_MAX);
+    map_detach(size);
+    EC.map_lost = SIZE_MAX;
+    lines_collect(&transform);
+    lines = transform.count;
+    transform.kept = malloc(transform.count ? transform.count : 1);
+    for (int k = 0; k < transform.count; ++k) {
+        document_row *row = transform.lines[k].row;
+        transform.kept[k] = !(row->flags & ROW_BORROWED) || row->content < EC.map ||
+                            row->content + row->size <= EC.map + size;
+    }
+    lines_compact(&transform);
+    lines_rebuild(&transform);
+    set_status("%s was cut short, %d lines past its end are gone", EC.file_name, lines - EC.document_rows);
+}
+
+// Looks for the file having been cut short from outside, which takes the end of the mapping with it.
+// Called before rows get looked at, as reading a page that's gone faults.
+void map_check() {
+    struct stat st;
+    size_t size = EC.map_lost;
+    if (EC.map_fd == -1) return;
+    if (fstat(EC.map_fd, &st) == 0 && (size_t) st.st_size < size) size = st.st_size;
+    // A followed file that shrank is read again from the top, so none of its old bytes can be trusted.
+    if (size < EC.map_size) map_cut(EC.follow.fd != -1 ? 0 : size);
 }
 
+// Writes the document next to the file and renames it over once it's safely on disk, so a failure
+// at any point leaves the old file untouched. The mapping keeps the old file alive for borrowed rows.
 void save_file() {
-    if (!EC.file_name) EC.file_name = show_prompt("Save as: %s");
+    if (EC.streaming) {
+        set_status("Still reading the input, saving waits for it to end");
+        return;
+    }
+    if (!EC.file_name) {
+        EC.file_name = show_prompt("Save as: %s", NULL);
+        if (EC.file_name) syntax_select(EC.file_name);
+    }
     if (!EC.file_name) {
         set_status("Cancelled operation!");
         return;
     }
+    load_wait(INT_MAX);
+    map_check();
 
-    int size;
-    char *buffer = rows_to_string(&size);
-    int file = open(EC.file_name, O_RDWR | O_CREAT, 0644);
-    if (file != -1) {
-        if (ftruncate(file, size) != -1) {
-            if (write(file, buffer, size) == size) {
-                close(file);
-                free(buffer);
-                set_status("%d bytes written to disk", size);
-                return;
+    char *target = realpath(EC.file_name, NULL), *path = target ? target : EC.file_name;
+    char temporary[strlen(path) + 8];
+    sprintf(temporary, "%s.XXXXXX", path);
+
+    struct stat st;
+    mode_t mask = umask(0);
+    umask(mask);
+    mode_t mode = stat(path, &st) == 0 ? st.st_mode & 07777 : 0666 & ~mask;
+
+    size_t size = 0;
+    int fd = mkstemp(temporary), error = fd == -1, unsynced = 0;
+    if (fd != -1) {
+        error = fchmod(fd, mode) == -1 || rows_write(fd, &size) == -1 || fsync(fd) == -1;
+        if (close(fd) == -1) error = 1;
+        if (!error && rename(temporary, path) == -1) error = 1;
+        // The data is in place by now, the rename just may not outlive a crash.
+        if (!error && directory_sync(path) == -1) unsynced = errno;
+        if (error) {
+            int saved = errno;
+            unlink(temporary);
+            errno = saved;
+        }
+    }
+    free(target);
+
+    if (error) {
+        set_status("Can't save! I/O error: %s", strerror(errno));
+        return;
+    }
+    if (!unsynced) set_status("%zu bytes written to disk", size);
+    else set_status("%zu bytes written to disk, but the directory can't be synced: %s", size, strerror(unsynced));
+    EC.follow.offset = size;
+    EC.follow.open_row = 0;
+    if (EC.follow.inotify != -1) { // Follow the file just written rather than take it for a new one.
+        follow_toggle();
+        follow_toggle();
+    }
+}
+
+/*** Follow mode ***/
+// Adds bytes read from the end of the file, finishing the last row first if it was cut short.
+void follow_append(char *p, size_t size) {
+    char *end = p + size;
+    while (p < end) {
+        char *newline = memchr(p, '\n', end - p), *line_end = newline ? newline : end;
+        if (EC.follow.open_row && EC.document_rows) {
+            int last = EC.document_rows - 1;
+            row_append_string(row_at(last), p, line_end - p);
+            row_changed(last);
+        } else {
+            row_append(EC.document_rows, p, line_end - p);
+        }
+
+        document_row *row = row_at(EC.document_rows - 1);
+        if (newline && row->size && row->content[row->size - 1] == '\r') {
+            row_delete_char(row, row->size - 1);
+            row_changed(EC.document_rows - 1);
+        }
+        EC.follow.open_row = !newline;
+        p = line_end + 1;
+    }
+}
+
+// Reads what was appended since last time. A file that got shorter was truncated, so it's read again
+// from the top, like a new one.
+void follow_read() {
+    struct follow *follow = &EC.follow;
+    struct stat st;
+    char block[LOAD_BLOCK];
+    ssize_t size;
+    int bottom = EC.cursor_y >= EC.document_rows - 1;
+
+    if (fstat(follow->fd, &st) == -1) return;
+    if (st.st_size < follow->offset) {
+        follow->offset = 0;
+        follow->open_row = 0;
+        set_status("%s was truncated", EC.file_name);
+        map_check(); // Rows still borrowing the old bytes go with them.
+    }
+    while ((size = pread(follow->fd, block, sizeof(block), follow->offset)) > 0) {
+        follow_append(block, size);
+        follow->offset += size;
+    }
+
+    if (bottom && EC.cursor_y < EC.document_rows - 1) { // Keep up with the new rows.
+        EC.cursor_y = EC.document_rows - 1;
+        EC.cursor_x = 0;
+    }
+}
+
+// Handles the events of the watched file and directory.
+void follow_update() {
+    struct follow *follow = &EC.follow;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const char *slash = strrchr(EC.file_name, '/'), *name = slash ? slash + 1 : EC.file_name;
+    int replaced = 0;
+    ssize_t size;
+
+    while ((size = read(follow->inotify, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + size;) {
+            struct inotify_event *event = (struct inotify_event *) p;
+            if (event->wd == follow->directory_watch && event->len && strcmp(event->name, name) == 0) replaced = 1;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    follow_read(); // Whatever made it to the old file before it was replaced still counts.
+    if (!replaced) return;
+
+    int fd = open(EC.file_name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    map_detach(EC.map_size); // Nothing watches the old file any more.
+    close(follow->fd);
+    follow->fd = fd;
+    follow->offset = 0;
+    follow->open_row = 0;
+    inotify_rm_watch(follow->inotify, follow->file_watch);
+    follow->file_watch = inotify_add_watch(follow->inotify, EC.file_name, IN_MODIFY);
+    set_status("%s was replaced, following the new one", EC.file_name);
+    follow_read();
+}
+
+// Starts or stops following the file, showing lines as they're appended to it.
+void follow_toggle() {
+    struct follow *follow = &EC.follow;
+    if (follow->inotify != -1) {
+        close(follow->inotify);
+        close(follow->fd);
+        follow->inotify = follow->fd = -1;
+        set_status("Stopped following %s", EC.file_name);
+        return;
+    }
+
+    struct stat st;
+    if (!EC.file_name || stat(EC.file_name, &st) == -1 || !S_ISREG(st.st_mode)) {
+        set_status("Only files on disk can be followed");
+        return;
+    }
+    load_wait(INT_MAX);
+
+    const char *slash = strrchr(EC.file_name, '/');
+    char directory[slash ? slash - EC.file_name + 2 : 2];
+    snprintf(directory, sizeof(directory), "%s", slash ? EC.file_name : ".");
+    follow->fd = open(EC.file_name, O_RDONLY | O_CLOEXEC);
+    follow->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (follow->fd == -1 || follow->inotify == -1) {
+        set_status("Can't follow %s: %s", EC.file_name, strerror(errno));
+        if (follow->fd != -1) close(follow->fd);
+        if (follow->inotify != -1) close(follow->inotify);
+        follow->inotify = follow->fd = -1;
+        return;
+    }
+    follow->file_watch = inotify_add_watch(follow->inotify, EC.file_name, IN_MODIFY);
+    follow->directory_watch = inotify_add_watch(follow->inotify, directory, IN_CREATE | IN_MOVED_TO);
+    set_status("Following %s", EC.file_name);
+    follow_read(); // It may have grown since it was opened.
+}
+
+/*** Replace ***/
+void scratch_append(struct replace_task *task, const char *p, size_t size) {
+    if (!size) return; // Empty replacements, before the scratch space may even exist.
+    if (task->scratch_size + size > task->scratch_capacity) {
+        task->scratch_capacity = (task->scratch_size + size) * 2;
+        task->scratch = realloc(task->scratch, task->scratch_capacity);
+    }
+    memcpy(&task->scratch[task->scratch_size], p, size);
+    task->scratch_size += size;
+}
+
+// Writes the replacement of one occurrence: \0 to \9 and & stand for the groups of the match, and a
+// backslash takes any other character as it is.
+void replacement_expand(struct replace_task *task, char *replacement, char *content, regmatch_t *groups) {
+    for (char *p = replacement; *p; ++p) {
+        int group = -1;
+        if (*p == '&') group = 0;
+        else if (*p == '\\' && p[1] >= '0' && p[1] <= '9') group = *++p - '0';
+        else if (*p == '\\' && p[1]) ++p;
+
+        if (group == -1) scratch_append(task, p, 1);
+        else if (groups[group].rm_so != -1)
+            scratch_append(task, &content[groups[group].rm_so], groups[group].rm_eo - groups[group].rm_so);
+    }
+}
+
+// Builds row in the task's scratch space with up to limit occurrences replaced. Returns how many there were.
+int replace_row(struct replace *replace, regex_t *compiled, document_row *row, int limit, struct replace_task *task) {
+    struct search *search = &replace->search;
+    regmatch_t groups[REPLACE_GROUPS];
+    int offset = 0, kept = 0, count = 0, previous = -1; // Where the last occurrence ended.
+
+    task->scratch_size = 0;
+    while (count < limit && offset <= row->size) {
+        if (compiled) {
+            groups[0].rm_so = offset;
+            groups[0].rm_eo = row->size;
+            if (regexec(compiled, row->content, REPLACE_GROUPS, groups, REG_STARTEND | (offset ? REG_NOTBOL : 0)))
+                break;
+        } else {
+            char *hit = literal_find(&row->content[offset], row->size - offset, search->literal, search->literal_size);
+            if (!hit) break;
+            groups[0].rm_so = hit - row->content;
+            groups[0].rm_eo = groups[0].rm_so + search->literal_size;
+            for (int k = 1; k < REPLACE_GROUPS; ++k)
+                groups[k].rm_so = groups[k].rm_eo = -1;
+        }
+
+        int empty = groups[0].rm_eo == groups[0].rm_so;
+        if (empty && groups[0].rm_so == previous) { // Nothing is left between this and the last one, like sed.
+            ++offset;
+            continue;
+        }
+        scratch_append(task, &row->content[kept], groups[0].rm_so - kept);
+        replacement_expand(task, replace->replacement, row->content, groups);
+        kept = offset = previous = groups[0].rm_eo;
+        offset += empty; // Or the same empty occurrence would be found again.
+        ++count;
+    }
+    if (count && kept < row->size) scratch_append(task, &row->content[kept], row->size - kept);
+    return count;
+}
+
+// Copies the row built in the task's scratch space out into content of its own.
+void replaced_set(struct replaced *replaced, struct replace_task *task) {
+    replaced->size = task->scratch_size;
+    replaced->content = malloc(content_capacity(task->scratch_size));
+    STAT_HELD(row_bytes, replaced->content);
+    memcpy(replaced->content, task->scratch, task->scratch_size);
+    replaced->content[task->scratch_size] = '\0';
+}
+
+// Keeps a rebuilt row.
+void replaced_push(struct replace_task *task, int i, int count) {
+    if (task->count == task->capacity) {
+        task->capacity = task->capacity ? task->capacity * 2 : 64;
+        task->rows = realloc(task->rows, sizeof(struct replaced) * task->capacity);
+    }
+    struct replaced *replaced = &task->rows[task->count++];
+    replaced->row = i;
+    replaced->count = count;
+    replaced_set(replaced, task);
+}
+
+void replace_task(int task, int worker, void *context) {
+    struct replace *replace = context;
+    struct search *search = &replace->search;
+    struct replace_task *result = &replace->tasks[task];
+    regex_t *compiled = search->compiled ? &search->compiled[worker] : NULL;
+    int from = task * search->rows_per_task, to = from + search->rows_per_task, found = 0, count;
+    if (to > search->row_count) to = search->row_count;
+
+    for (int i = from; i < to && found < replace->limit; i += count) {
+        int start;
+        row_node *node = node_find(i, &start, 0);
+        count = node->size - (i - start);
+        if (count > to - i) count = to - i;
+        if (node->trigrams && !trigrams_contain(node->trigrams, search->trigrams, search->trigram_count)) continue;
+
+        for (int j = 0; j < count && found < replace->limit; ++j) {
+            int replaced = replace_row(replace, compiled, &node->row[i - start + j], replace->limit - found, result);
+            if (!replaced) continue;
+            replaced_push(result, i + j, replaced);
+            found += replaced;
+        }
+    }
+}
+
+// Replaces the occurrences of a pattern all over the document. Workers rebuild the rows that change on
+// the heap, then those rows are swapped in, in order, until the limit is reached. Only they have their
+// render, highlight and search results redone.
+void replace(char *pattern, char *replacement, int limit) {
+    struct replace replace = {.replacement = replacement, .limit = limit};
+    struct search *search = &replace.search;
+    int tasks = workers_size() * 4, occurrences = 0, rows = 0;
+
+    if (!lines_ready()) return;
+    if (search_compile(search, pattern) == -1) {
+        set_status("Regular expression error");
+        return;
+    }
+
+    search->row_count = EC.document_rows;
+    search->rows_per_task = (search->row_count + tasks - 1) / tasks;
+    if (search->rows_per_task < ROW_CHUNK) search->rows_per_task = ROW_CHUNK;
+    tasks = (search->row_count + search->rows_per_task - 1) / search->rows_per_task;
+    replace.tasks = calloc(tasks ? tasks : 1, sizeof(struct replace_task));
+    workers_run(tasks, replace_task, &replace);
+
+    for (int t = 0; t < tasks; ++t) {
+        struct replace_task *task = &replace.tasks[t];
+        for (int k = 0; k < task->count; ++k) {
+            struct replaced *replaced = &task->rows[k];
+            document_row *row = row_at(replaced->row);
+            if (occurrences + replaced->count > limit) { // Tasks didn't know about the ones before them.
+                STAT_RELEASED(row_bytes, replaced->content);
+                free(replaced->content);
+                if (occurrences == limit) continue; // Left as it was.
+                replaced->count = replace_row(&replace, search->compiled, row, limit - occurrences, task);
+                replaced_set(replaced, task);
             }
+
+            row_free(row);
+            row_init(row, replaced->content, replaced->size, 1);
+            row->flags &= ~ROW_BORROWED; // Its content was made for it.
+            index_row(replaced->row);
+            syntax_invalidate(replaced->row);
+            occurrences += replaced->count;
+            ++rows;
+        }
+        free(task->rows);
+        free(task->scratch);
+    }
+    free(replace.tasks);
+    search_free(search);
+
+    if (rows && EC.search.literal) find_start(); // Rows may match differently now.
+    if (EC.cursor_y < EC.document_rows && EC.cursor_x > row_at(EC.cursor_y)->size)
+        EC.cursor_x = row_at(EC.cursor_y)->size;
+    set_status("%d incidences replaced in %d lines", occurrences, rows);
+}
+
+/*** Line transforms ***/
+// Number a row starts with, after any blanks, as sort -n reads it. Rows without one count as 0.
+double row_number(document_row *row) {
+    char *p = row->content, *end = p + row->size;
+    double number = 0, scale = 1, sign = 1;
+    int fraction = 0;
+
+    while (p < end && (*p == ' ' || *p == '\t')) ++p;
+    if (p < end && *p == '-') {
+        sign = -1;
+        ++p;
+    }
+    for (; p < end; ++p) {
+        if (isdigit((unsigned char) *p) && fraction) number += (*p - '0') * (scale /= 10);
+        else if (isdigit((unsigned char) *p)) number = number * 10 + (*p - '0');
+        else if (*p == '.' && !fraction) fraction = 1;
+        else break;
+    }
+    return sign * number;
+}
+
+int rows_compare(document_row *a, document_row *b) {
+    int result = memcmp(a->content, b->content, a->size < b->size ? a->size : b->size);
+    return result ? result : (a->size > b->size) - (a->size < b->size);
+}
+
+// Orders lines bytewise or by number. Lines that compare equal keep the order they had, so sorts are stable.
+int line_compare(const void *a, const void *b, void *context) {
+    const struct line *x = a, *y = b;
+    struct transform *transform = context;
+    int result = transform->numeric ? (x->number > y->number) - (x->number < y->number) : rows_compare(x->row, y->row);
+    if (transform->reverse) result = -result;
+    return result ? result : x->index - y->index;
+}
+
+// Gathers pointers to every row in order, splitting them in ranges for a job of the worker pool. Returns
+// how many tasks there are.
+int lines_collect(struct transform *transform) {
+    int tasks = workers_size() * 4;
+    transform->count = EC.document_rows;
+    transform->lines = malloc(sizeof(struct line) * (transform->count ? transform->count : 1));
+    for (int i = 0, count = 0; i < transform->count; i += count) {
+        document_row *row = row_span(i, &count);
+        for (int k = 0; k < count; ++k) {
+            transform->lines[i + k].row = &row[k];
+            transform->lines[i + k].index = i + k;
+        }
+    }
+
+    transform->lines_per_task = (transform->count + tasks - 1) / tasks;
+    if (transform->lines_per_task < ROW_CHUNK) transform->lines_per_task = ROW_CHUNK;
+    return (transform->count + transform->lines_per_task - 1) / transform->lines_per_task;
+}
+
+void node_release(row_node *node) {
+    if (!node) return;
+    node_release(node->left);
+    node_release(node->right);
+    free(node->trigrams);
+    STAT_RELEASED(row_bytes, node);
+    free(node);
+}
+
+// Puts the document back together from the lines left, in their order. Rows are moved into new chunks
+// as they are, renders and all, so only those coming after a different row than before are queued to
+// have their end state worked out again. Queued and rendered rows keep being so where they end up.
+void lines_rebuild(struct transform *transform) {
+    row_node *tree = NULL, *chunk = NULL;
+    int *dirty = malloc(sizeof(int) * (transform->count ? transform->count : 1)), dirty_count = 0;
+    int rendered_capacity = EC.rendered_count ? EC.rendered_count : 1, rendered_count = 0;
+    int *rendered = malloc(sizeof(int) * rendered_capacity);
+    for (int k = 0; k < transform->count; ++k) {
+        struct line *line = &transform->lines[k];
+        int moved = k ? transform->lines[k - 1].index != line->index - 1 : line->index != 0;
+        int queued = syntax_find(line->index), shown = rendered_find(line->index);
+        queued = queued < EC.syntax_dirty_count && EC.syntax_dirty[queued] == line->index;
+        if (EC.syntax.multiline && (moved || queued)) dirty[dirty_count++] = k;
+        if (shown < EC.rendered_count && EC.rendered[shown] == line->index) rendered[rendered_count++] = k;
+
+        if (!chunk) chunk = node_new();
+        chunk->row[chunk->size++] = *line->row;
+        if (chunk->size == ROW_CHUNK || k + 1 == transform->count) {
+            node_update(chunk);
+            tree = node_merge(tree, chunk);
+            chunk = NULL;
+        }
+    }
+    node_release(EC.row);
+    EC.row = tree;
+    EC.document_rows = transform->count;
+    free(transform->lines);
+
+    free(EC.syntax_dirty);
+    EC.syntax_dirty_capacity = dirty_count > 16 ? dirty_count : 16;
+    EC.syntax_dirty = realloc(dirty, sizeof(int) * EC.syntax_dirty_capacity);
+    EC.syntax_dirty_count = dirty_count;
+    free(EC.rendered);
+    EC.rendered = rendered;
+    EC.rendered_count = rendered_count;
+    EC.rendered_capacity = rendered_capacity;
+    if (EC.search.literal) find_start();
+    if (EC.map_size >= INDEX_MIN_SIZE) index_start(); // The new chunks haven't been indexed.
+    if (EC.cursor_y > EC.document_rows) EC.cursor_y = EC.document_rows;
+    if (EC.cursor_y < EC.document_rows && EC.cursor_x > row_at(EC.cursor_y)->size)
+        EC.cursor_x = row_at(EC.cursor_y)->size;
+}
+
+// Drops the lines that weren't kept, keeping the order of the rest.
+void lines_compact(struct transform *transform) {
+    int count = 0;
+    for (int k = 0; k < transform->count; ++k) {
+        if (transform->kept[k]) transform->lines[count++] = transform->lines[k];
+        else row_free(transform->lines[k].row);
+    }
+    transform->count = count;
+    free(transform->kept);
+}
+
+// Edits need the whole document in place, which may never happen with a pipe.
+int lines_ready() {
+    if (EC.streaming) {
+        set_status("Still reading the input, edits wait for it to end");
+        return 0;
+    }
+    load_wait(INT_MAX);
+    return 1;
+}
+
+void sort_task(int task, int worker, void *context) {
+    struct transform *transform = context;
+    int from = task * transform->lines_per_task, to = from + transform->lines_per_task;
+    (void) worker;
+    if (to > transform->count) to = transform->count;
+
+    for (int k = from; transform->numeric && k < to; ++k)
+        transform->lines[k].number = row_number(transform->lines[k].row);
+    qsort_r(&transform->lines[from], to - from, sizeof(struct line), line_compare, transform);
+}
+
+// Merges a pair of neighbouring sorted runs into one twice as long.
+void merge_task(int task, int worker, void *context) {
+    struct transform *transform = context;
+    int from = task * 2 * transform->run, middle = from + transform->run, to = middle + transform->run;
+    (void) worker;
+    if (middle > transform->count) middle = transform->count; // The last run may have no pair.
+    if (to > transform->count) to = transform->count;
+    int a = from, b = middle, k = from;
+
+    while (a < middle && b < to) {
+        if (line_compare(&transform->lines[b], &transform->lines[a], transform) < 0)
+            transform->merged[k++] = transform->lines[b++];
+        else
+            transform->merged[k++] = transform->lines[a++];
+    }
+    memcpy(&transform->merged[k], &transform->lines[a], sizeof(struct line) * (middle - a));
+    k += middle - a;
+    memcpy(&transform->merged[k], &transform->lines[b], sizeof(struct line) * (to - b));
+}
+
+// Sorts the lines of the document. Each task sorts a range of row pointers, then ranges are merged in
+// pairs, every round spread over the worker pool too, until one is left. Content is never copied.
+void lines_sort(int numeric, int reverse) {
+    struct transform transform = {.numeric = numeric, .reverse = reverse};
+    if (!lines_ready()) return;
+
+    int tasks = lines_collect(&transform);
+    workers_run(tasks, sort_task, &transform);
+    transform.merged = malloc(sizeof(struct line) * (transform.count ? transform.count : 1));
+    for (transform.run = transform.lines_per_task; transform.run < transform.count; transform.run *= 2) {
+        struct line *lines = transform.lines;
+        workers_run((transform.count + 2 * transform.run - 1) / (2 * transform.run), merge_task, &transform);
+        transform.lines = transform.merged;
+        transform.merged = lines;
+    }
+    free(transform.merged);
+
+    lines_rebuild(&transform);
+    set_status("%d lines sorted", EC.document_rows);
+}
+
+void uniq_task(int task, int worker, void *context) {
+    struct transform *transform = context;
+    int from = task * transform->lines_per_task, to = from + transform->lines_per_task;
+    (void) worker;
+    if (to > transform->count) to = transform->count;
+
+    for (int k = from; k < to; ++k)
+        transform->kept[k] = k == 0 || rows_compare(transform->lines[k - 1].row, transform->lines[k].row) != 0;
+}
+
+// Drops lines that repeat the one before them, like uniq.
+void lines_uniq() {
+    struct transform transform = {0};
+    if (!lines_ready()) return;
+
+    int tasks = lines_collect(&transform), lines = transform.count;
+    transform.kept = malloc(transform.count ? transform.count : 1);
+    workers_run(tasks, uniq_task, &transform);
+    lines_compact(&transform);
+    lines_rebuild(&transform);
+    set_status("%d repeated lines dropped", lines - EC.document_rows);
+}
+
+void filter_task(int task, int worker, void *context) {
+    struct transform *transform = context;
+    struct search *search = &transform->search;
+    int from = task * transform->lines_per_task, to = from + transform->lines_per_task;
+    regmatch_t match;
+    if (to > transform->count) to = transform->count;
+
+    for (int k = from; k < to; ++k) {
+        document_row *row = transform->lines[k].row;
+        int found;
+        if (search->compiled) {
+            match.rm_so = 0;
+            match.rm_eo = row->size;
+            found = regexec(&search->compiled[worker], row->content, 1, &match, REG_STARTEND) == 0;
+        } else {
+            found = literal_find(row->content, row->size, search->literal, search->literal_size) != NULL;
         }
-        close(file);
+        transform->kept[k] = found == transform->keep;
+    }
+}
+
+// Keeps only the lines matching a pattern, or only those that don't.
+void lines_filter(char *pattern, int keep) {
+    struct transform transform = {.keep = keep};
+    if (!lines_ready()) return;
+    if (search_compile(&transform.search, pattern) == -1) {
+        set_status("Regular expression error");
+        return;
     }
-    free(buffer);
-    set_status("Can't save! I/O error: %s", strerror(errno));
+
+    int tasks = lines_collect(&transform), lines = transform.count;
+    transform.kept = malloc(transform.count ? transform.count : 1);
+    workers_run(tasks, filter_task, &transform);
+    search_free(&transform.search);
+    lines_compact(&transform);
+    lines_rebuild(&transform);
+    set_status("%d lines kept, %d dropped", EC.document_rows, lines - EC.document_rows);
 }
 
 /*** Init ***/
+#ifndef RED_NO_MAIN // Left out by programs driving the editor themselves, like the benchmark.
 int main(int argc, char *argv[]) {
-    editor_enable();
+    int stream = argc >= 2 && strcmp(argv[1], "-") == 0; // The document comes through stdin, keys from the tty.
+    int terminal = stream ? open("/dev/tty", O_RDWR | O_CLOEXEC) : STDIN_FILENO;
+    if (terminal == -1) editor_exit("/dev/tty");
+    editor_enable(terminal, STDOUT_FILENO);
     editor_init();
-    if (argc >= 2) {
+    if (stream) {
+        open_stream(STDIN_FILENO); // Rows get drawn as they come, with no telling how long that takes.
+    } else if (argc >= 2) {
         open_file(argv[1]);
+        load_wait(EC.rows);
+        if (EC.map_size >= INDEX_MIN_SIZE) index_start();
     }
 
     set_status("Ctrl + [Q-Quit, S-Save, E-Edit, C-Command, R-Read]");
 
     while (1) {
-        refresh_screen();
+        if (!input_pending()) refresh_screen(); // Keys already waiting are taken first, then drawn once.
         process_key();
     }
 }
+#endif